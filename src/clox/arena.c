@@ -0,0 +1,139 @@
+#include <string.h>
+
+#include "arena.h"
+#include "memory.h"
+
+// allocations are aligned to 16 bytes, enough for any type clox puts in an arena
+#define ARENA_ALIGN(size) (((size) + 15) & ~(size_t)15)
+// a big allocation, e.g. the code of a long script, gets a block of its own, so it can grow with realloc
+// instead of leaving a copy behind every time it doubles
+#define IS_LARGE(size) (ARENA_ALIGN(size) > ARENA_BLOCK_SIZE / 4)
+
+struct ArenaBlock
+{
+    ArenaBlock *next;
+    size_t size;
+    size_t used;
+    // a large block holds a single big allocation, see IS_LARGE
+    bool large;
+    // the memory handed out follows the header, and the header's size keeps it aligned
+    _Alignas(16) uint8_t data[];
+};
+
+void init_arena(Arena *arena)
+{
+    arena->blocks = NULL;
+}
+
+static ArenaBlock *new_block(size_t size, bool large)
+{
+    ArenaBlock *block = (ArenaBlock *)reallocate(NULL, 0, sizeof(ArenaBlock) + size, MEM_ARENA);
+    block->size = size;
+    block->used = 0;
+    block->large = large;
+    return block;
+}
+
+static void free_block(ArenaBlock *block)
+{
+    reallocate(block, sizeof(ArenaBlock) + block->size, 0, MEM_ARENA);
+}
+
+void *arena_allocate(Arena *arena, size_t size)
+{
+    size = ARENA_ALIGN(size);
+    ArenaBlock *block = arena->blocks;
+    if (IS_LARGE(size))
+    {
+        // it goes behind the block being bumped through, which stays in use
+        block = new_block(size, true);
+        if (arena->blocks == NULL)
+        {
+            block->next = NULL;
+            arena->blocks = block;
+        }
+        else
+        {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        }
+    }
+    else if (block == NULL || block->size - block->used < size)
+    {
+        block = new_block(ARENA_BLOCK_SIZE, false);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    void *result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+void *arena_grow(Arena *arena, void *pointer, size_t old_size, size_t new_size)
+{
+    ArenaBlock *block = arena->blocks;
+    if (pointer != NULL && !IS_LARGE(new_size) && block != NULL &&
+        (uint8_t *)pointer + ARENA_ALIGN(old_size) == block->data + block->used)
+    {
+        size_t start = (uint8_t *)pointer - block->data;
+        if (block->size - start >= ARENA_ALIGN(new_size))
+        {
+            block->used = start + ARENA_ALIGN(new_size);
+            return pointer;
+        }
+    }
+
+    if (pointer != NULL && IS_LARGE(old_size) && IS_LARGE(new_size))
+    {
+        ArenaBlock **link = &arena->blocks;
+        while ((*link)->data != pointer || !(*link)->large)
+            link = &(*link)->next;
+        ArenaBlock *large = *link;
+        large = (ArenaBlock *)reallocate(large, sizeof(ArenaBlock) + large->size,
+                                         sizeof(ArenaBlock) + ARENA_ALIGN(new_size), MEM_ARENA);
+        large->size = ARENA_ALIGN(new_size);
+        large->used = large->size;
+        *link = large;
+        return large->data;
+    }
+
+    // the old allocation stays where it is until the arena is reset
+    void *result = arena_allocate(arena, new_size);
+    if (pointer != NULL)
+        memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+    return result;
+}
+
+void *arena_promote(Arena *arena, void *pointer, size_t size, MemCategory category)
+{
+    if (size == 0)
+        return NULL;
+
+    for (ArenaBlock **link = &arena->blocks; *link != NULL; link = &(*link)->next)
+    {
+        ArenaBlock *block = *link;
+        if (block->data != pointer || !block->large)
+            continue;
+        // the allocation moves to the start of its block, which shrinks to fit it
+        *link = block->next;
+        track_memory(MEM_ARENA, sizeof(ArenaBlock) + block->size, 0);
+        memmove(block, block->data, size);
+        return reallocate(block, 0, size, category);
+    }
+
+    void *result = reallocate(NULL, 0, size, category);
+    memcpy(result, pointer, size);
+    return result;
+}
+
+void free_arena(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        free_block(block);
+        block = next;
+    }
+    init_arena(arena);
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+#include "memory.h"
+
+// an Arena hands out memory by bumping a pointer through big blocks, and takes it all back at once, for
+// data that dies together, e.g. everything the compiler needs only while it compiles. Nothing allocated
+// in an arena is freed on its own: memory that has to outlive the arena is promoted out of it first
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock ArenaBlock;
+
+struct Arena
+{
+    // the block being bumped through, which links to the ones filled before it
+    ArenaBlock *blocks;
+};
+
+void init_arena(Arena *arena);
+void *arena_allocate(Arena *arena, size_t size);
+// arena_grow resizes an allocation, in place if it's the last one in its block and there's room
+void *arena_grow(Arena *arena, void *pointer, size_t old_size, size_t new_size);
+// arena_promote moves the first size bytes of an allocation onto the heap, as if they had been allocated
+// with reallocate under category. A big allocation's block is handed over as it is, small ones are copied
+void *arena_promote(Arena *arena, void *pointer, size_t size, MemCategory category);
+// free_arena takes back everything allocated in the arena at once
+void free_arena(Arena *arena);
+
+#define ARENA_ALLOCATE(arena, type, count) (type *)arena_allocate(arena, sizeof(type) * (count))
+
+#define ARENA_GROW_ARRAY(arena, type, pointer, old_count, new_count) \
+    (type *)arena_grow(arena, pointer, sizeof(type) * (old_count), sizeof(type) * (new_count))
+
+#endif
\ No newline at end of file
@@ -1,5 +1,7 @@
+#include "arena.h"
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 
 // pass by pointer since we need to modify it
 void init_chunk(Chunk *chunk)
@@ -8,6 +10,7 @@ void init_chunk(Chunk *chunk)
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->arena = NULL;
     init_value_array(&chunk->constants);
 }
 
@@ -17,8 +20,16 @@ void write_chunk(Chunk *chunk, uint8_t byte, int line)
     {
         int old_capacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+        if (chunk->arena != NULL)
+        {
+            chunk->code = ARENA_GROW_ARRAY(chunk->arena, uint8_t, chunk->code, old_capacity, chunk->capacity);
+            chunk->lines = ARENA_GROW_ARRAY(chunk->arena, int, chunk->lines, old_capacity, chunk->capacity);
+        }
+        else
+        {
+            chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity, MEM_CHUNK_CODE);
+            chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity, MEM_CHUNK_LINES);
+        }
     }
 
     chunk->lines[chunk->count] = line;
@@ -29,11 +40,39 @@ void write_chunk(Chunk *chunk, uint8_t byte, int line)
 void free_chunk(Chunk *chunk)
 {
     free_value_array(&chunk->constants);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    if (chunk->arena == NULL)
+    {
+        FREE_ARRAY(int, chunk->lines, chunk->capacity, MEM_CHUNK_LINES);
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity, MEM_CHUNK_CODE);
+    }
     init_chunk(chunk);
 }
 
+// set_chunk_arena makes an empty chunk grow its code, lines and constants in arena
+void set_chunk_arena(Chunk *chunk, Arena *arena)
+{
+    chunk->arena = arena;
+    chunk->constants.arena = arena;
+}
+
+// promote_chunk copies a chunk that grew in an arena onto the heap, into arrays of exactly the size it
+// ended up with, so it outlives the arena
+void promote_chunk(Chunk *chunk)
+{
+    if (chunk->arena == NULL)
+        return;
+    chunk->code = arena_promote(chunk->arena, chunk->code, chunk->count, MEM_CHUNK_CODE);
+    chunk->lines = arena_promote(chunk->arena, chunk->lines, chunk->count * sizeof(int), MEM_CHUNK_LINES);
+    chunk->capacity = chunk->count;
+    chunk->arena = NULL;
+
+    ValueArray *constants = &chunk->constants;
+    constants->values =
+        arena_promote(constants->arena, constants->values, constants->count * sizeof(Value), MEM_CONSTANTS);
+    constants->capacity = constants->count;
+    constants->arena = NULL;
+}
+
 // adds a constant to the constant dynamic array of chunk (which is a representation of a clox program; instructions and data)
 // this will be called by the VM once implemented
 // returns the index at which the constant was added for later easy access
@@ -60,7 +99,147 @@ void write_constant(Chunk *chunk, Value value, int line)
         write_chunk(chunk, OP_CONSTANT_LONG, line);
         int constant_ptr = add_constant_to_chunk(chunk, value);
         write_chunk(chunk, constant_ptr & 0b11111111, line);
-        write_chunk(chunk, constant_ptr & (0b11111111 << 8), line);
-        write_chunk(chunk, constant_ptr & (0b11111111 << 16), line);
+        write_chunk(chunk, (constant_ptr >> 8) & 0b11111111, line);
+        write_chunk(chunk, (constant_ptr >> 16) & 0b11111111, line);
+    }
+}
+
+// instruction_length is the size of the instruction at offset, or 0 for an opcode it doesn't know
+int instruction_length(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NEGATE:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_RETURN:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+    case OP_ADD_GENERIC:
+        return 1;
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_STORE_LOCAL:
+        return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_LOOP:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+        return 4;
+    case OP_INVOKE:
+    case OP_INVOKE_THIS:
+    case OP_SUPER_INVOKE:
+        return 5;
+    case OP_CLOSURE:
+    {
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + 2 * function->upvalue_count;
+    }
+    default:
+        if (chunk->code[offset] >= OP_ADD_LL && chunk->code[offset] < OP_STORE_LOCAL)
+            return (chunk->code[offset] - OP_ADD_LL) % 4 < 2 ? 3 : 4;
+        return 0;
+    }
+}
+
+int stack_effect(uint8_t op, uint8_t *operands)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_CLOSURE:
+    case OP_GET_UPVALUE:
+    case OP_CLASS:
+        return 1;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+        return 0;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+    case OP_ADD_GENERIC:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_RETURN:
+    case OP_DEFINE_GLOBAL:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_CLOSE_UPVALUE:
+    case OP_METHOD:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_INHERIT:
+    case OP_STORE_LOCAL:
+        return -1;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return -2;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return -operands[0];
+    case OP_INVOKE:
+    case OP_INVOKE_THIS:
+        return -operands[1];
+    case OP_SUPER_INVOKE:
+        return -operands[1] - 1;
+    default:
+        // the register forms push their result, unless they store it into a local
+        return (op - OP_ADD_LL) % 4 < 2 ? 1 : 0;
     }
 }
\ No newline at end of file
@@ -31,6 +31,76 @@ typedef enum
     OP_SET_GLOBAL,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
+    // jumps take a 16-bit operand: the distance to jump forward (or backward for OP_LOOP) from the
+    // end of the instruction
+    OP_JUMP,
+    // OP_JUMP_IF_FALSE leaves the condition on the stack, since it's the value of an "and" / "or"
+    // expression, whereas OP_POP_JUMP_IF_FALSE pops it, for conditions of statements
+    OP_JUMP_IF_FALSE,
+    OP_POP_JUMP_IF_FALSE,
+    // fused compare-and-branch instructions: a comparison whose only use is to decide a jump
+    // (e.g. the condition of an if or a loop) compiles to one of these instead of a comparison
+    // followed by OP_POP_JUMP_IF_FALSE. They pop both operands and jump when the condition is false
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_GREATER,
+    // "a <= b" compiles to !(a > b), so its condition is false exactly when a > b (and likewise for >=)
+    OP_JUMP_IF_GREATER,
+    OP_JUMP_IF_LESS,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
+    OP_LOOP,
+    // the operand is the number of arguments, which sit on the stack above the callee
+    OP_CALL,
+    // a call whose result is returned right away, it reuses the caller's frame
+    OP_TAIL_CALL,
+    // the operand is the function constant, followed by an (is_local, index) pair per upvalue
+    OP_CLOSURE,
+    OP_GET_UPVALUE,
+    OP_SET_UPVALUE,
+    // moves the local on top of the stack into its upvalue, and pops it
+    OP_CLOSE_UPVALUE,
+    OP_CLASS,
+    // the operand is the name of the method, the method itself is on top of the stack, the class below it
+    OP_METHOD,
+    // the property instructions take the name constant, and a two-byte index of their inline cache
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    // the method calls take the name constant, the argument count, and a two-byte index of their method
+    // cache. OP_INVOKE_THIS is OP_INVOKE when the receiver is "this", which is known to be an instance
+    OP_INVOKE,
+    OP_INVOKE_THIS,
+    // the superclass is on top of the stack, above the receiver (and the arguments)
+    OP_SUPER_INVOKE,
+    OP_GET_SUPER,
+    // copies the superclass's methods down into the subclass on top of the stack
+    OP_INHERIT,
+    // quickened forms of OP_ADD, which the VM rewrites OP_ADD into once it has seen the operands' types.
+    // The compiler never emits these
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_ADD_GENERIC,
+    // register forms of arithmetic, which address locals directly instead of going through the stack.
+    // _LL takes two local slots, _LK a local slot and a constant, and pushes the result. The _TO forms
+    // take a destination slot first and store the result there instead. The compiler relies on the
+    // order: the _TO form of an op is two after it
+    OP_ADD_LL,
+    OP_ADD_LK,
+    OP_ADD_LL_TO,
+    OP_ADD_LK_TO,
+    OP_SUBTRACT_LL,
+    OP_SUBTRACT_LK,
+    OP_SUBTRACT_LL_TO,
+    OP_SUBTRACT_LK_TO,
+    OP_MULTIPLY_LL,
+    OP_MULTIPLY_LK,
+    OP_MULTIPLY_LL_TO,
+    OP_MULTIPLY_LK_TO,
+    OP_DIVIDE_LL,
+    OP_DIVIDE_LK,
+    OP_DIVIDE_LL_TO,
+    OP_DIVIDE_LK_TO,
+    // pops the value on top of the stack into a local, i.e. OP_SET_LOCAL followed by OP_POP
+    OP_STORE_LOCAL,
 } OpCode;
 
 // Chunk represents a clox program, which is a dynamic array of opcodes / bytecode instructions
@@ -42,12 +112,22 @@ typedef struct
     uint8_t *code;
     ValueArray constants;
     int *lines;
+    // the compiler grows chunks in its arena, and moves them onto the heap when they're done, see
+    // promote_chunk. NULL once the chunk is on the heap
+    Arena *arena;
 } Chunk;
 
 void init_chunk(Chunk *chunk);
 void write_chunk(Chunk *chunk, uint8_t byte, int line);
 void free_chunk(Chunk *chunk);
+void set_chunk_arena(Chunk *chunk, Arena *arena);
+void promote_chunk(Chunk *chunk);
 int add_constant_to_chunk(Chunk *chunk, Value constant);
 void write_constant(Chunk *chunk, Value value, int line);
+// instruction_length is the size of the instruction at offset, or 0 for an opcode it doesn't know
+int instruction_length(Chunk *chunk, int offset);
+// stack_effect is the number of values the instruction op pushes, minus the number it pops. operands are the
+// bytes following the opcode. A return counts as popping the value it returns
+int stack_effect(uint8_t op, uint8_t *operands);
 
 #endif
\ No newline at end of file
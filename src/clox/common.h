@@ -5,8 +5,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_TRACE_EXECUTION
-#define DEBUG_PRINT_CODE
+// the debug flags are set by the "debug" make target (-DDEBUG_TRACE_EXECUTION -DDEBUG_PRINT_CODE),
+// since dumping the bytecode and tracing every instruction swamps the output of any real program
+// #define DEBUG_TRACE_EXECUTION
+// #define DEBUG_PRINT_CODE
+// DEBUG_STRESS_GC starts a collection at every safepoint after an allocation, to shake out objects the
+// collector misses
+// #define DEBUG_STRESS_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
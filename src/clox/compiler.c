@@ -2,7 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "compiler.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "output.h"
 #include "scanner.h"
 #include "value.h"
 
@@ -46,30 +50,119 @@ typedef struct
 {
     Token name;
     int depth;
+    // is_captured is set once a closure captures the local, only then does it have to be closed over
+    // when it goes out of scope, the others are simply popped
+    bool is_captured;
 } Local;
 
+// Upvalue is a variable of an enclosing function that a closure captures. is_local tells whether it's a
+// local of the immediately enclosing function, index being its slot, or one of that function's own
+// upvalues, index being its position in the enclosing function's upvalues
 typedef struct
 {
+    uint8_t index;
+    bool is_local;
+} Upvalue;
+
+// FusableComparison remembers the comparison that was emitted last, so that a conditional jump right
+// after it can be fused with it into a single compare-and-branch instruction
+typedef struct
+{
+    // start and end are the offsets of the comparison's instruction(s) in the chunk
+    int start;
+    int end;
+    OpCode fused_jump;
+} FusableComparison;
+
+typedef enum
+{
+    TYPE_FUNCTION,
+    TYPE_INITIALIZER,
+    TYPE_METHOD,
+    TYPE_SCRIPT,
+} FunctionType;
+
+// LoadRecord remembers the last instruction that loaded a local (OP_GET_LOCAL) or a constant (OP_CONSTANT),
+// so that an arithmetic instruction whose operands are exactly such loads can take them over as operands
+typedef struct
+{
+    int start;
+    int end;
+    bool is_local;
+    uint8_t operand;
+} LoadRecord;
+
+// there's a Compiler for each function being compiled, they form a stack through enclosing, with
+// the top-level script at the bottom
+typedef struct Compiler
+{
+    struct Compiler *enclosing;
+    ObjFunction *function;
+    FunctionType type;
+    // arena holds whatever the compiler needs only while it compiles the function: the chunk as it grows,
+    // code that's cut to be pasted again, and the optimizer's and max_stack's work. It's freed when the
+    // function is done, so the garbage of one function doesn't pile up while the rest of the script compiles
+    Arena arena;
+
     Local locals[UINT8_COUNT];
     int local_count;
+    Upvalue upvalues[UINT8_COUNT];
     int scope_depth;
+    FusableComparison comparison;
+    // jump_target is the offset the last patched forward jump lands on
+    int jump_target;
+    // last_call is the offset of the last OP_CALL, a return statement turns it into a tail call if
+    // the call is the last thing its expression does
+    int last_call;
+    // last_this is the offset just past the last "this" loaded, so a method call can tell that its
+    // receiver is "this"
+    int last_this;
+    // for the register forms of arithmetic: the last load, the offset of the last register instruction
+    // pushing its result, and the offset of the last OP_SET_LOCAL
+    LoadRecord last_load;
+    int last_register_op;
+    int last_set_local;
 } Compiler;
 
+// CodeFragment holds bytecode that was cut out of the chunk, to be pasted back further down
+typedef struct
+{
+    int count;
+    uint8_t *code;
+    int *lines;
+} CodeFragment;
+
 Parser parser;
+// ClassCompiler tracks the class declarations being compiled, so "this" can tell whether it's in a method
+typedef struct ClassCompiler
+{
+    struct ClassCompiler *enclosing;
+    bool has_superclass;
+} ClassCompiler;
+
+// register_ops enables the register forms of arithmetic, which read locals and constants directly
+// and store straight into locals. Without them the compiler emits plain stack code
+static bool register_ops = true;
+// optimize runs the optimizer over each function once it's compiled. It's off by default, compiling stays a
+// single pass over the source then
+static bool optimize = false;
+
 Compiler *current = NULL;
-Chunk *compiling_chunk;
+ClassCompiler *current_class = NULL;
 
 static ParseRule *get_rule(TokenType type);
 static void parse_precedence(Precedence precedence);
 static void expression();
 static void statement();
 static void declaration();
+static bool identifiers_equal(Token *a, Token *b);
 
 static void error_at(Token *token, const char *message)
 {
     if (parser.panic_mode)
         return;
     parser.panic_mode = true;
+    flush_output();
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
@@ -126,7 +219,7 @@ static void consume(TokenType type, const char *message)
 
 Chunk *current_chunk()
 {
-    return compiling_chunk;
+    return &current->function->chunk;
 }
 
 static void emit_byte(uint8_t byte)
@@ -140,9 +233,14 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2)
     emit_byte(byte2);
 }
 
+static bool check(TokenType type)
+{
+    return parser.current.type == type;
+}
+
 static bool match(TokenType type)
 {
-    if (parser.current.type == type)
+    if (check(type))
     {
         advance();
         return true;
@@ -151,32 +249,255 @@ static bool match(TokenType type)
     return false;
 }
 
+// emit_jump emits a forward jump with a placeholder offset, and returns the offset of the placeholder,
+// for patch_jump to fill in once we know where the jump lands
+static int emit_jump(uint8_t instruction)
+{
+    emit_byte(instruction);
+    emit_byte(0xff);
+    emit_byte(0xff);
+    return current_chunk()->count - 2;
+}
+
+// patch_jump makes the jump at offset land on the next instruction to be emitted
+static void patch_jump(int offset)
+{
+    // -2 to adjust for the jump offset operand itself
+    int jump = current_chunk()->count - offset - 2;
+    if (jump > UINT16_MAX)
+    {
+        error("Too much code to jump over.");
+    }
+
+    current_chunk()->code[offset] = (jump >> 8) & 0xff;
+    current_chunk()->code[offset + 1] = jump & 0xff;
+    current->jump_target = current_chunk()->count;
+}
+
+static void emit_loop(int loop_start)
+{
+    emit_byte(OP_LOOP);
+
+    // +2 to jump back over the offset operand as well
+    int offset = current_chunk()->count - loop_start + 2;
+    if (offset > UINT16_MAX)
+        error("Loop body too large.");
+
+    emit_byte((offset >> 8) & 0xff);
+    emit_byte(offset & 0xff);
+}
+
+static void mark_fusable(int start, OpCode fused_jump)
+{
+    current->comparison.start = start;
+    current->comparison.end = current_chunk()->count;
+    current->comparison.fused_jump = fused_jump;
+}
+
+// emit_condition_jump emits the jump that skips the body of an if statement or a loop when the
+// condition that was just compiled is falsey, popping the condition. If the condition ended with a
+// comparison, e.g. "i < n", the comparison is replaced by a fused compare-and-branch instruction,
+// which saves a dispatch and the push and pop of the boolean in between
+static int emit_condition_jump()
+{
+    Chunk *chunk = current_chunk();
+    FusableComparison *comparison = &current->comparison;
+
+    // fusing is only safe when the comparison is the last thing emitted, and no jump lands right
+    // after it: e.g. in "a and b < c" the "and" jumps there with only a single value on the stack
+    if (comparison->end == chunk->count && current->jump_target != chunk->count)
+    {
+        chunk->count = comparison->start;
+        comparison->end = -1;
+        return emit_jump(comparison->fused_jump);
+    }
+
+    return emit_jump(OP_POP_JUMP_IF_FALSE);
+}
+
+// cut_code moves the code emitted since start out of the chunk, into fragment. Jumps inside it are
+// relative, so it can be pasted back anywhere
+static void cut_code(int start, CodeFragment *fragment)
+{
+    Chunk *chunk = current_chunk();
+    fragment->count = chunk->count - start;
+    fragment->code = ARENA_ALLOCATE(&current->arena, uint8_t, fragment->count);
+    fragment->lines = ARENA_ALLOCATE(&current->arena, int, fragment->count);
+    memcpy(fragment->code, chunk->code + start, fragment->count);
+    memcpy(fragment->lines, chunk->lines + start, fragment->count * sizeof(int));
+    chunk->count = start;
+    // the comparison or call, if any, was cut as well
+    current->comparison.end = -1;
+    current->last_call = -1;
+    current->last_this = -1;
+    current->last_load.end = -1;
+    current->last_register_op = -1;
+    current->last_set_local = -1;
+}
+
+static void paste_code(CodeFragment *fragment)
+{
+    for (int i = 0; i < fragment->count; i++)
+    {
+        write_chunk(current_chunk(), fragment->code[i], fragment->lines[i]);
+    }
+    fragment->count = 0;
+}
+
+// emit_return returns nil, for functions whose body runs off the end without a return statement
 static void emit_return()
 {
+    // an initializer always returns the instance it initialized
+    if (current->type == TYPE_INITIALIZER)
+        emit_bytes(OP_GET_LOCAL, 0);
+    else
+        emit_byte(OP_NIL);
     emit_byte(OP_RETURN);
-#ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error)
+}
+
+// emit_property_op emits a get or set property instruction, which gets an inline cache of its own
+static void emit_property_op(uint8_t op, uint8_t name)
+{
+    int cache = current->function->cache_count++;
+    if (cache > UINT16_MAX)
+        error("Too many property accesses in one function.");
+    emit_bytes(op, name);
+    emit_bytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+// emit_invoke_op emits a method invocation, which gets a method cache of its own
+static void emit_invoke_op(uint8_t op, uint8_t name, uint8_t arg_count)
+{
+    int cache = current->function->method_cache_count++;
+    if (cache > UINT16_MAX)
+        error("Too many method calls in one function.");
+    emit_bytes(op, name);
+    emit_byte(arg_count);
+    emit_bytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+// max_stack works out how many stack slots a call of the function needs at most, by following the code
+// from the start with the number of values on the stack: slot zero and the parameters, plus whatever the
+// instructions push. The depth before an instruction is the same whichever way control gets there
+static int max_stack(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int max = function->arity + 1;
+    if (chunk->count == 0)
+        return max;
+
+    // depths holds the depth before each instruction that has been reached, -1 for the others. Each
+    // instruction goes onto the worklist once, when it's first reached
+    int *depths = ARENA_ALLOCATE(&current->arena, int, chunk->count);
+    int *worklist = ARENA_ALLOCATE(&current->arena, int, chunk->count);
+    for (int offset = 0; offset < chunk->count; offset++)
+        depths[offset] = -1;
+    depths[0] = max;
+    worklist[0] = 0;
+    int worklist_count = 1;
+
+    while (worklist_count > 0)
     {
-        disassemble_chunk(current_chunk(), "code");
+        int offset = worklist[--worklist_count];
+        uint8_t op = chunk->code[offset];
+        int depth = depths[offset] + stack_effect(op, chunk->code + offset + 1);
+        if (depth > max)
+            max = depth;
+
+        int next = offset + instruction_length(chunk, offset);
+        int successors[2];
+        int successor_count = 0;
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN && next < chunk->count)
+            successors[successor_count++] = next;
+        if (op >= OP_JUMP && op <= OP_LOOP)
+        {
+            int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            successors[successor_count++] = op == OP_LOOP ? next - jump : next + jump;
+        }
+        for (int i = 0; i < successor_count; i++)
+        {
+            if (depths[successors[i]] == -1)
+            {
+                depths[successors[i]] = depth;
+                worklist[worklist_count++] = successors[i];
+            }
+        }
     }
-#endif
+
+    return max;
 }
 
-static void end_compiler()
+static ObjFunction *end_compiler()
 {
     emit_return();
+    ObjFunction *function = current->function;
+    if (optimize && !parser.had_error)
+        optimize_function(function);
+    // the function outlives the compiler, so its chunk has to move out of the arena
+    promote_chunk(&function->chunk);
+    if (!parser.had_error)
+        function->max_stack = max_stack(function);
+    // the caches start out empty
+    function->caches = ALLOCATE(PropertyCache, function->cache_count, MEM_FUNCTIONS);
+    if (function->cache_count > 0)
+        memset(function->caches, 0, function->cache_count * sizeof(PropertyCache));
+    function->method_caches = ALLOCATE(MethodCache, function->method_cache_count, MEM_FUNCTIONS);
+    if (function->method_cache_count > 0)
+        memset(function->method_caches, 0, function->method_cache_count * sizeof(MethodCache));
+#ifdef DEBUG_PRINT_CODE
+    if (!parser.had_error)
+    {
+        disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+    }
+#endif
+    free_arena(&current->arena);
+    current = current->enclosing;
+    return function;
 }
 
-static void init_compiler(Compiler *compiler)
+static void init_compiler(Compiler *compiler, FunctionType type)
 {
+    compiler->enclosing = current;
+    compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
+    compiler->comparison.end = -1;
+    compiler->jump_target = -1;
+    compiler->last_call = -1;
+    compiler->last_this = -1;
+    compiler->last_load.end = -1;
+    compiler->last_register_op = -1;
+    compiler->last_set_local = -1;
+    compiler->function = new_function();
+    init_arena(&compiler->arena);
+    set_chunk_arena(&compiler->function->chunk, &compiler->arena);
     current = compiler;
+    if (type != TYPE_SCRIPT)
+    {
+        // the name token points into the source, which doesn't outlive the compiler
+        current->function->name = copy_string(parser.previous.start, parser.previous.length);
+    }
+
+    // slot zero holds the function being called, or the receiver in methods, which user code refers to as
+    // "this". The empty name means user code can't refer to the function
+    Local *local = &current->locals[current->local_count++];
+    local->depth = 0;
+    local->is_captured = false;
+    if (type == TYPE_METHOD || type == TYPE_INITIALIZER)
+    {
+        local->name.start = "this";
+        local->name.length = 4;
+    }
+    else
+    {
+        local->name.start = "";
+        local->name.length = 0;
+    }
 }
 
 static uint8_t make_constant(Value value)
 {
-    int constant = add_constant_to_chunk(compiling_chunk, value);
+    int constant = add_constant_to_chunk(current_chunk(), value);
     if (constant > UINT8_MAX)
     {
         error("Too many constants in one chunk.");
@@ -186,9 +507,31 @@ static uint8_t make_constant(Value value)
     return (uint8_t)constant;
 }
 
+// record_load records the two-byte load instruction that was just emitted
+static void record_load(bool is_local, uint8_t operand)
+{
+    current->last_load.start = current_chunk()->count - 2;
+    current->last_load.end = current_chunk()->count;
+    current->last_load.is_local = is_local;
+    current->last_load.operand = operand;
+}
+
+// emit_constant loads a literal value. Unlike the constants that name variables, whose index has to fit
+// into an instruction's single byte operand, literals can use OP_CONSTANT_LONG, so a chunk can have
+// up to 2^24 of them (e.g. generated data-heavy scripts)
 static void emit_constant(Value value)
 {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+    if (current_chunk()->constants.count >= (1 << 24))
+    {
+        error("Too many constants in one chunk.");
+        return;
+    }
+    Chunk *chunk = current_chunk();
+    int start = chunk->count;
+    write_constant(chunk, value, parser.previous.line);
+
+    if (chunk->code[start] == OP_CONSTANT)
+        record_load(false, chunk->code[start + 1]);
 }
 
 static uint8_t identifier_constant(Token *name)
@@ -198,8 +541,8 @@ static uint8_t identifier_constant(Token *name)
 
 static void number(bool can_assign)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(value));
+    // the scanner already converted the literal while scanning it
+    emit_constant(NUMBER_VAL(parser.previous.number));
 }
 
 static void string(bool can_assign)
@@ -211,9 +554,9 @@ static int resolve_local(Compiler *compiler, Token *name)
 {
     // we walk starting from "last in" so that local variables shadow
     // variables from the surrounding scope
-    for (int i = current->local_count - 1; i >= 0; i--)
+    for (int i = compiler->local_count - 1; i >= 0; i--)
     {
-        Local *local = &current->locals[i];
+        Local *local = &compiler->locals[i];
         if (identifiers_equal(&local->name, name))
         {
             if (local->depth == -1)
@@ -227,6 +570,50 @@ static int resolve_local(Compiler *compiler, Token *name)
     return -1;
 }
 
+static int add_upvalue(Compiler *compiler, uint8_t index, bool is_local)
+{
+    int upvalue_count = compiler->function->upvalue_count;
+
+    // a closure that refers to the same variable several times captures it only once
+    for (int i = 0; i < upvalue_count; i++)
+    {
+        Upvalue *upvalue = &compiler->upvalues[i];
+        if (upvalue->index == index && upvalue->is_local == is_local)
+            return i;
+    }
+
+    if (upvalue_count == UINT8_COUNT)
+    {
+        error("Too many closure variables in function.");
+        return 0;
+    }
+
+    compiler->upvalues[upvalue_count].is_local = is_local;
+    compiler->upvalues[upvalue_count].index = index;
+    return compiler->function->upvalue_count++;
+}
+
+// resolve_upvalue looks for name in the enclosing functions. Each function in between captures it as
+// well, so that at runtime, every closure only ever reaches into the function right around it
+static int resolve_upvalue(Compiler *compiler, Token *name)
+{
+    if (compiler->enclosing == NULL)
+        return -1;
+
+    int local = resolve_local(compiler->enclosing, name);
+    if (local != -1)
+    {
+        compiler->enclosing->locals[local].is_captured = true;
+        return add_upvalue(compiler, (uint8_t)local, true);
+    }
+
+    int upvalue = resolve_upvalue(compiler->enclosing, name);
+    if (upvalue != -1)
+        return add_upvalue(compiler, (uint8_t)upvalue, false);
+
+    return -1;
+}
+
 static void named_variable(Token name, bool can_assign)
 {
     uint8_t get_op, set_op;
@@ -240,6 +627,11 @@ static void named_variable(Token name, bool can_assign)
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
     }
+    else if ((arg = resolve_upvalue(current, &name)) != -1)
+    {
+        get_op = OP_GET_UPVALUE;
+        set_op = OP_SET_UPVALUE;
+    }
     else
     {
         arg = identifier_constant(&name);
@@ -249,12 +641,16 @@ static void named_variable(Token name, bool can_assign)
     if (can_assign && match(TOKEN_EQUAL))
     {
         expression();
-        emit_bytes(get_op, (uint8_t)arg);
+        if (set_op == OP_SET_LOCAL)
+            current->last_set_local = current_chunk()->count;
+        emit_bytes(set_op, (uint8_t)arg);
     }
     else
     {
         // global variables are late-bound, i.e., resolved at runtime, not compile time
-        emit_bytes(set_op, (uint8_t)arg);
+        emit_bytes(get_op, (uint8_t)arg);
+        if (get_op == OP_GET_LOCAL)
+            record_load(true, (uint8_t)arg);
     }
 }
 
@@ -263,6 +659,83 @@ static void variable(bool can_assign)
     named_variable(parser.previous, can_assign);
 }
 
+static uint8_t argument_list();
+
+static void dot(bool can_assign)
+{
+    bool on_this = current->last_this == current_chunk()->count;
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifier_constant(&parser.previous);
+
+    if (can_assign && match(TOKEN_EQUAL))
+    {
+        expression();
+        emit_property_op(OP_SET_PROPERTY, name);
+    }
+    else if (match(TOKEN_LEFT_PAREN))
+    {
+        // "obj.method(...)" looks the method up and calls it in one go, without creating a bound method
+        uint8_t arg_count = argument_list();
+        emit_invoke_op(on_this ? OP_INVOKE_THIS : OP_INVOKE, name, arg_count);
+    }
+    else
+    {
+        emit_property_op(OP_GET_PROPERTY, name);
+    }
+}
+
+static void this_(bool can_assign)
+{
+    if (current_class == NULL)
+    {
+        error("Can't use 'this' outside of a class.");
+        return;
+    }
+
+    // "this" is a local variable in slot zero of methods, closures capture it like any other
+    variable(false);
+    current->last_this = current_chunk()->count;
+}
+
+static Token synthetic_token(const char *text)
+{
+    Token token;
+    token.start = text;
+    token.length = (int)strlen(text);
+    return token;
+}
+
+static void super_(bool can_assign)
+{
+    if (current_class == NULL)
+    {
+        error("Can't use 'super' outside of a class.");
+    }
+    else if (!current_class->has_superclass)
+    {
+        error("Can't use 'super' in a class with no superclass.");
+    }
+
+    consume(TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint8_t name = identifier_constant(&parser.previous);
+
+    // the receiver is "this", the method is looked up in the superclass, which the class declaration
+    // keeps in a local called "super"
+    named_variable(synthetic_token("this"), false);
+    if (match(TOKEN_LEFT_PAREN))
+    {
+        uint8_t arg_count = argument_list();
+        named_variable(synthetic_token("super"), false);
+        emit_invoke_op(OP_SUPER_INVOKE, name, arg_count);
+    }
+    else
+    {
+        named_variable(synthetic_token("super"), false);
+        emit_bytes(OP_GET_SUPER, name);
+    }
+}
+
 static void literal(bool can_assign)
 {
     Token token = parser.previous;
@@ -286,6 +759,46 @@ static void literal(bool can_assign)
 // the left-hand-side operand has already been compiled and its value has been pushed
 // onto the stack, so this function only compiles the operator and r.h.s expression
 // the expression can be any expression involing higer-precedence operators, since they "bind tigher"
+// emit_register_op replaces "GET_LOCAL a; GET_LOCAL b; ADD" with "ADD_LL a b", or "GET_LOCAL a;
+// CONSTANT k; ADD" with "ADD_LK a k", and likewise for the other arithmetic operators, if the right
+// operand that was just compiled is a lone load too. Returns false if it doesn't apply
+static bool emit_register_op(TokenType operator_type, LoadRecord left)
+{
+    OpCode op;
+    switch (operator_type)
+    {
+    case TOKEN_PLUS:
+        op = OP_ADD_LL;
+        break;
+    case TOKEN_MINUS:
+        op = OP_SUBTRACT_LL;
+        break;
+    case TOKEN_STAR:
+        op = OP_MULTIPLY_LL;
+        break;
+    case TOKEN_SLASH:
+        op = OP_DIVIDE_LL;
+        break;
+    default:
+        return false;
+    }
+
+    Chunk *chunk = current_chunk();
+    LoadRecord right = current->last_load;
+    if (!register_ops || right.end != chunk->count || right.start != left.end ||
+        current->jump_target == chunk->count || chunk->code[left.start] != OP_GET_LOCAL)
+        return false;
+
+    if (!right.is_local)
+        op = (OpCode)(op + 1);
+    chunk->count = left.start;
+    current->last_load.end = -1;
+    current->last_register_op = chunk->count;
+    emit_bytes(op, left.operand);
+    emit_byte(right.operand);
+    return true;
+}
+
 static void binary(bool can_assign)
 {
     TokenType operator_type = parser.previous.type;
@@ -295,8 +808,18 @@ static void binary(bool can_assign)
     // so only the l.h.s operand contains the binary operator
     // we ensure that by parsing the r.h.s expression using operators with _strictly_ higher precedence
     // not the same precedence
+    // the left operand is already compiled, if it's a lone local it may become an operand of the
+    // register form. A jump that lands right after it rules that out: it came from a different path
+    LoadRecord left = current->last_load;
+    bool left_is_local = left.end == current_chunk()->count && left.is_local &&
+                         current->jump_target != left.end;
+
     parse_precedence((Precedence)(rule->precedence + 1));
 
+    if (left_is_local && emit_register_op(operator_type, left))
+        return;
+
+    int start = current_chunk()->count;
     switch (operator_type)
     {
     case TOKEN_PLUS:
@@ -313,27 +836,85 @@ static void binary(bool can_assign)
         break;
     case TOKEN_EQUAL_EQUAL:
         emit_byte(OP_EQUAL);
+        mark_fusable(start, OP_JUMP_IF_NOT_EQUAL);
         break;
     case TOKEN_GREATER:
         emit_byte(OP_GREATER);
+        mark_fusable(start, OP_JUMP_IF_NOT_GREATER);
         break;
     case TOKEN_LESS:
         emit_byte(OP_LESS);
+        mark_fusable(start, OP_JUMP_IF_NOT_LESS);
         break;
     case TOKEN_BANG_EQUAL:
         emit_bytes(OP_EQUAL, OP_NOT);
+        mark_fusable(start, OP_JUMP_IF_EQUAL);
         break;
     case TOKEN_GREATER_EQUAL:
         emit_bytes(OP_LESS, OP_NOT);
+        mark_fusable(start, OP_JUMP_IF_LESS);
         break;
     case TOKEN_LESS_EQUAL:
         emit_bytes(OP_GREATER, OP_NOT);
+        mark_fusable(start, OP_JUMP_IF_GREATER);
         break;
     default:
         return;
     }
 }
 
+// "and" and "or" short-circuit: the right operand is only evaluated if the left one doesn't decide
+// the result already. The value of the expression is whichever operand was evaluated last
+static void and_(bool can_assign)
+{
+    int end_jump = emit_jump(OP_JUMP_IF_FALSE);
+
+    emit_byte(OP_POP);
+    parse_precedence(PREC_AND);
+
+    patch_jump(end_jump);
+}
+
+static void or_(bool can_assign)
+{
+    int else_jump = emit_jump(OP_JUMP_IF_FALSE);
+    int end_jump = emit_jump(OP_JUMP);
+
+    patch_jump(else_jump);
+    emit_byte(OP_POP);
+
+    parse_precedence(PREC_OR);
+    patch_jump(end_jump);
+}
+
+static uint8_t argument_list()
+{
+    uint8_t arg_count = 0;
+    if (!check(TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            // the arguments are left on the stack right above the callee, where the callee's frame
+            // expects its parameters, so they are passed without copying
+            expression();
+            if (arg_count == 255)
+            {
+                error("Can't have more than 255 arguments.");
+            }
+            arg_count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return arg_count;
+}
+
+static void call(bool can_assign)
+{
+    uint8_t arg_count = argument_list();
+    current->last_call = current_chunk()->count;
+    emit_bytes(OP_CALL, arg_count);
+}
+
 static void unary(bool can_assign)
 {
     // we've already consumed the prefix unary operator, so it's in the previous token
@@ -376,6 +957,73 @@ static void print_statement()
     emit_byte(OP_PRINT);
 }
 
+static void return_statement()
+{
+    if (current->type == TYPE_SCRIPT)
+    {
+        error("Can't return from top-level code.");
+    }
+
+    if (match(TOKEN_SEMICOLON))
+    {
+        emit_return();
+    }
+    else
+    {
+        if (current->type == TYPE_INITIALIZER)
+        {
+            error("Can't return a value from an initializer.");
+        }
+
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // "return f(...)": nothing in this frame is needed after the call, so the callee can take the
+        // frame over, and a tail-recursive function runs in constant stack space. The OP_RETURN stays,
+        // for natives, which return to this frame, and for any jumps that land after the call
+        Chunk *chunk = current_chunk();
+        if (current->last_call == chunk->count - 2 && chunk->code[current->last_call] == OP_CALL)
+        {
+            chunk->code[current->last_call] = OP_TAIL_CALL;
+        }
+        emit_byte(OP_RETURN);
+    }
+}
+
+// emit_discard pops the value of an expression statement. An assignment to a local then doesn't need to
+// leave its value on the stack: "SET_LOCAL a; POP" becomes "STORE_LOCAL a", and when the value came from
+// a register instruction, it stores the result itself, e.g. "a = b + c" becomes "ADD_LL_TO a b c"
+static void emit_discard()
+{
+    Chunk *chunk = current_chunk();
+    int set = current->last_set_local;
+    if (!register_ops || set != chunk->count - 2 || chunk->code[set] != OP_SET_LOCAL)
+    {
+        emit_byte(OP_POP);
+        return;
+    }
+
+    uint8_t slot = chunk->code[set + 1];
+    int op = current->last_register_op;
+    // a jump landing on the SET_LOCAL comes from a path that didn't run the register instruction
+    if (op == set - 3 && current->jump_target != set && chunk->code[op] >= OP_ADD_LL &&
+        chunk->code[op] < OP_STORE_LOCAL)
+    {
+        uint8_t left = chunk->code[op + 1];
+        uint8_t right = chunk->code[op + 2];
+        OpCode store_op = (OpCode)(chunk->code[op] + 2);
+        chunk->count = op;
+        emit_bytes(store_op, slot);
+        emit_bytes(left, right);
+    }
+    else
+    {
+        chunk->code[set] = OP_STORE_LOCAL;
+    }
+    current->last_set_local = -1;
+    current->last_register_op = -1;
+}
+
 // an expression statement evaluates an expression for its side effect, and discards its result
 // _i.e._, pops it off the stack, since statements must always leave the stack unchanged, with no additions
 // or deletions. An example of expression statements are function calls, since they produce values but it
@@ -386,7 +1034,7 @@ static void expression_statement()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emit_byte(OP_POP);
+    emit_discard();
 }
 
 static void begin_scope()
@@ -398,8 +1046,12 @@ static void end_scope()
 {
     while (current->local_count > 0 && current->locals[current->local_count - 1].depth == current->scope_depth)
     {
-        // local variables are stored on the VM stack, not in the globals hash table, so we need to clear them
-        emit_byte(OP_POP);
+        // local variables are stored on the VM stack, not in the globals hash table, so we need to clear them.
+        // Captured ones move off the stack into their upvalue first, the closures might outlive the scope
+        if (current->locals[current->local_count - 1].is_captured)
+            emit_byte(OP_CLOSE_UPVALUE);
+        else
+            emit_byte(OP_POP);
         current->local_count--;
     }
     current->scope_depth--;
@@ -415,12 +1067,116 @@ static void block()
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
+static void if_statement()
+{
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int then_jump = emit_condition_jump();
+    statement();
+
+    if (match(TOKEN_ELSE))
+    {
+        int else_jump = emit_jump(OP_JUMP);
+        patch_jump(then_jump);
+        statement();
+        patch_jump(else_jump);
+    }
+    else
+    {
+        // no else branch, so there's nothing for the then branch to jump over
+        patch_jump(then_jump);
+    }
+}
+
+static void while_statement()
+{
+    int loop_start = current_chunk()->count;
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exit_jump = emit_condition_jump();
+    statement();
+    emit_loop(loop_start);
+
+    patch_jump(exit_jump);
+}
+
+static void var_declaration();
+
+static void for_statement()
+{
+    // a variable declared in the initializer is scoped to the loop
+    begin_scope();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(TOKEN_SEMICOLON))
+    {
+        // no initializer
+    }
+    else if (match(TOKEN_VAR))
+    {
+        var_declaration();
+    }
+    else
+    {
+        expression_statement();
+    }
+
+    int loop_start = current_chunk()->count;
+    int exit_jump = -1;
+    if (!match(TOKEN_SEMICOLON))
+    {
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        exit_jump = emit_condition_jump();
+    }
+
+    // the increment clause comes before the body in the source, but runs after it. Instead of jumping
+    // over it to the body and back, its code is cut out of the chunk and pasted back after the body,
+    // which saves two jumps per iteration
+    CodeFragment increment = {0, NULL, NULL};
+    if (!match(TOKEN_RIGHT_PAREN))
+    {
+        int increment_start = current_chunk()->count;
+        expression();
+        emit_discard();
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        cut_code(increment_start, &increment);
+    }
+
+    statement();
+    paste_code(&increment);
+    emit_loop(loop_start);
+
+    if (exit_jump != -1)
+        patch_jump(exit_jump);
+    end_scope();
+}
+
 static void statement()
 {
     if (match(TOKEN_PRINT))
     {
         print_statement();
     }
+    else if (match(TOKEN_RETURN))
+    {
+        return_statement();
+    }
+    else if (match(TOKEN_IF))
+    {
+        if_statement();
+    }
+    else if (match(TOKEN_WHILE))
+    {
+        while_statement();
+    }
+    else if (match(TOKEN_FOR))
+    {
+        for_statement();
+    }
     else if (match(TOKEN_LEFT_BRACE))
     {
         // blocks and functions create local scope
@@ -448,14 +1204,14 @@ static void synchronize()
         }
         switch (parser.current.type)
         {
-        TOKEN_IF:
-        TOKEN_FOR:
-        TOKEN_WHILE:
-        TOKEN_CLASS:
-        TOKEN_FUN:
-        TOKEN_VAR:
-        TOKEN_PRINT:
-        TOKEN_RETURN:
+        case TOKEN_IF:
+        case TOKEN_FOR:
+        case TOKEN_WHILE:
+        case TOKEN_CLASS:
+        case TOKEN_FUN:
+        case TOKEN_VAR:
+        case TOKEN_PRINT:
+        case TOKEN_RETURN:
             return;
         default:;
             // do nothing, essentially discarding the tokens until we get to a statement boundary
@@ -472,9 +1228,10 @@ static void add_local(Token name)
         error("Only a maximum of 256 local variables is supported.");
         return;
     }
-    Local local = current->locals[current->local_count++];
-    local.name = name;
-    local.depth = -1;
+    Local *local = &current->locals[current->local_count++];
+    local->name = name;
+    local->depth = -1;
+    local->is_captured = false;
 }
 
 static bool identifiers_equal(Token *a, Token *b)
@@ -523,6 +1280,9 @@ static uint8_t parse_variable(const char *error_msg)
 
 static void mark_initialized()
 {
+    // a global function declaration marks nothing, globals are defined by OP_DEFINE_GLOBAL
+    if (current->scope_depth == 0)
+        return;
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
@@ -554,10 +1314,136 @@ static void var_declaration()
     define_variable(global);
 }
 
+// function compiles the parameters and body of a function into a new function object, whose creation
+// is then emitted into the enclosing function as a constant
+static void function(FunctionType type)
+{
+    Compiler compiler;
+    init_compiler(&compiler, type);
+    // there's no end_scope, the frame is discarded as a whole when the function returns
+    begin_scope();
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            current->function->arity++;
+            if (current->function->arity > 255)
+            {
+                error_at_current("Can't have more than 255 parameters.");
+            }
+            uint8_t constant = parse_variable("Expect parameter name.");
+            define_variable(constant);
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block();
+
+    ObjFunction *function = end_compiler();
+
+    // a function that doesn't capture anything needs no closure, it's a constant like any other,
+    // so evaluating its declaration allocates nothing
+    if (function->upvalue_count == 0)
+    {
+        emit_constant(OBJ_VAL(function));
+        return;
+    }
+
+    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+    // the operands tell the VM where to capture each upvalue from
+    for (int i = 0; i < function->upvalue_count; i++)
+    {
+        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
+        emit_byte(compiler.upvalues[i].index);
+    }
+}
+
+static void method()
+{
+    consume(TOKEN_IDENTIFIER, "Expect method name.");
+    uint8_t constant = identifier_constant(&parser.previous);
+
+    FunctionType type = TYPE_METHOD;
+    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0)
+        type = TYPE_INITIALIZER;
+
+    function(type);
+    emit_bytes(OP_METHOD, constant);
+}
+
+static void class_declaration()
+{
+    consume(TOKEN_IDENTIFIER, "Expect class name.");
+    Token class_name = parser.previous;
+    uint8_t name_constant = identifier_constant(&parser.previous);
+    declare_variable();
+
+    emit_bytes(OP_CLASS, name_constant);
+    define_variable(name_constant);
+
+    ClassCompiler class_compiler;
+    class_compiler.has_superclass = false;
+    class_compiler.enclosing = current_class;
+    current_class = &class_compiler;
+
+    if (match(TOKEN_LESS))
+    {
+        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(false);
+        if (identifiers_equal(&class_name, &parser.previous))
+        {
+            error("A class can't inherit from itself.");
+        }
+
+        // the superclass stays on the stack as a local called "super" in a scope around the methods,
+        // so the methods capture it like any other variable
+        begin_scope();
+        add_local(synthetic_token("super"));
+        define_variable(0);
+
+        named_variable(class_name, false);
+        emit_byte(OP_INHERIT);
+        class_compiler.has_superclass = true;
+    }
+
+    // the methods are attached to the class one at a time, so the class goes on the stack meanwhile
+    named_variable(class_name, false);
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    {
+        method();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emit_byte(OP_POP);
+
+    if (class_compiler.has_superclass)
+        end_scope();
+
+    current_class = current_class->enclosing;
+}
+
+static void fun_declaration()
+{
+    uint8_t global = parse_variable("Expect function name.");
+    // a function can refer to itself in its body, so it's usable right away
+    mark_initialized();
+    function(TYPE_FUNCTION);
+    define_variable(global);
+}
+
 static void declaration()
 {
-    // TODO: Add variable declaration
-    if (match(TOKEN_VAR))
+    if (match(TOKEN_CLASS))
+    {
+        class_declaration();
+    }
+    else if (match(TOKEN_FUN))
+    {
+        fun_declaration();
+    }
+    else if (match(TOKEN_VAR))
     {
         var_declaration();
     }
@@ -571,12 +1457,12 @@ static void declaration()
 }
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
     [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
@@ -593,7 +1479,7 @@ ParseRule rules[] = {
     [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
-    [TOKEN_AND] = {NULL, NULL, PREC_NONE},
+    [TOKEN_AND] = {NULL, and_, PREC_AND},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
@@ -601,11 +1487,11 @@ ParseRule rules[] = {
     [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-    [TOKEN_OR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
@@ -650,26 +1536,32 @@ static void parse_precedence(Precedence precedence)
     }
 }
 
-bool compile(const char *source, Chunk *chunk)
+void set_register_ops(bool enabled)
 {
-    init_scanner(source);
+    register_ops = enabled;
+}
 
-    Compiler compiler;
-    init_compiler(&compiler);
+void set_optimize(bool enabled)
+{
+    optimize = enabled;
+}
 
-    compiling_chunk = chunk;
+ObjFunction *compile(const char *source, size_t length)
+{
+    init_scanner(source, length);
+
+    Compiler compiler;
+    init_compiler(&compiler, TYPE_SCRIPT);
 
     parser.had_error = false;
     parser.panic_mode = false;
 
-    int line = -1;
-
     advance();
     while (!match(TOKEN_EOF))
     {
         declaration();
     }
-    end_compiler();
+    ObjFunction *function = end_compiler();
 
-    return !parser.had_error;
+    return parser.had_error ? NULL : function;
 }
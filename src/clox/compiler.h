@@ -4,6 +4,13 @@
 #include "object.h"
 #include "vm.h"
 
-bool compile(const char *source, Chunk *chunk);
+// compile returns the top-level function of the script, or NULL if there was a compile error
+ObjFunction *compile(const char *source, size_t length);
+// set_register_ops turns the register forms of arithmetic on or off (they're on by default), e.g. to
+// compare against plain stack code
+void set_register_ops(bool enabled);
+// set_optimize turns the optimizer on or off (it's off by default), for long-running scripts where the
+// time spent optimizing pays off
+void set_optimize(bool enabled);
 
 #endif
\ No newline at end of file
@@ -1,9 +1,10 @@
-#include <stdio.h>
 #include "debug.h"
+#include "object.h"
+#include "output.h"
 
 void disassemble_chunk(Chunk *chunk, const char *name)
 {
-    printf("== %s ==\n", name);
+    write_format("== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;)
     // iterate in this interesting way because instructions aren't of uniform size
@@ -16,51 +17,122 @@ void disassemble_chunk(Chunk *chunk, const char *name)
 
 int simple_instruction(const char *name, int offset)
 {
-    printf("%s\n", name);
+    write_cstring(name);
+    write_char('\n');
     return offset + 1;
 }
 
 int constant_instruction(const char *name, Chunk *chunk, int offset)
 {
     uint8_t constant_ptr = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, constant_ptr);
+    write_format("%-16s %4d '", name, constant_ptr);
     print_value(chunk->constants.values[constant_ptr]);
-    printf("'\n");
+    write_cstring("'\n");
     return offset + 2;
 }
 
 static int byte_instruction(const char *name, Chunk *chunk, int offset)
 {
     uint8_t slot = chunk->code[offset + 1];
-    printf("%-16s %4d\n", name, slot);
+    write_format("%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
+// register_instruction prints a register form of arithmetic: the destination slot if it has one, the left
+// operand's slot, and the right operand's slot or constant
+static int register_instruction(const char *name, Chunk *chunk, int offset, bool has_dst, bool constant_operand)
+{
+    write_format("%-16s", name);
+    if (has_dst)
+        write_format(" %4d <-", chunk->code[++offset]);
+    write_format(" %4d", chunk->code[offset + 1]);
+    uint8_t right = chunk->code[offset + 2];
+    if (constant_operand)
+    {
+        write_format(" %4d '", right);
+        print_value(chunk->constants.values[right]);
+        write_cstring("'\n");
+    }
+    else
+    {
+        write_format(" %4d\n", right);
+    }
+    return offset + 3;
+}
+
+// jump_instruction prints where the jump lands, sign is -1 for jumps going backwards
+static int jump_instruction(const char *name, int sign, Chunk *chunk, int offset)
+{
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    write_format("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    return offset + 3;
+}
+
 int constant_long_instruction(const char *name, Chunk *chunk, int offset)
 {
     uint8_t constant_ptr_lowest_byte = chunk->code[offset + 1];
-    uint8_t constant_ptr_middle_byte = chunk->code[offset + 1];
-    uint8_t constant_ptr_highest_byte = chunk->code[offset + 1];
-    int constant_ptr = constant_ptr_lowest_byte | constant_ptr_middle_byte | constant_ptr_highest_byte;
-    printf("%-16s %4d '", name, constant_ptr);
+    uint8_t constant_ptr_middle_byte = chunk->code[offset + 2];
+    uint8_t constant_ptr_highest_byte = chunk->code[offset + 3];
+    int constant_ptr = constant_ptr_lowest_byte | (constant_ptr_middle_byte << 8) | (constant_ptr_highest_byte << 16);
+    write_format("%-16s %4d '", name, constant_ptr);
     print_value(chunk->constants.values[constant_ptr]);
-    printf("'\n");
+    write_cstring("'\n");
+    return offset + 4;
+}
+
+// property_instruction prints the property's name and the index of the site's inline cache
+static int property_instruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    write_format("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    write_format("' cache %d\n", cache);
     return offset + 4;
 }
 
+static int invoke_instruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t arg_count = chunk->code[offset + 2];
+    int cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    write_format("%-16s (%d args) %4d '", name, arg_count, constant);
+    print_value(chunk->constants.values[constant]);
+    write_format("' cache %d\n", cache);
+    return offset + 5;
+}
+
+static int closure_instruction(Chunk *chunk, int offset)
+{
+    offset++;
+    uint8_t constant = chunk->code[offset++];
+    write_format("%-16s %4d ", "OP_CLOSURE", constant);
+    print_value(chunk->constants.values[constant]);
+    write_char('\n');
+
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int i = 0; i < function->upvalue_count; i++)
+    {
+        int is_local = chunk->code[offset++];
+        int index = chunk->code[offset++];
+        write_format("%04d    |                     %s %d\n", offset - 2, is_local ? "local" : "upvalue", index);
+    }
+    return offset;
+}
+
 int disassemble_instruction(Chunk *chunk, int offset)
 {
-    printf("%04d ", offset);
+    write_format("%04d ", offset);
 
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
     {
         // instruction on same line as previous instruction
-        printf("   | ");
+        write_cstring("   | ");
     }
     else
     {
         // instruction on new line
-        printf("%4d ", chunk->lines[offset]);
+        write_format("%4d ", chunk->lines[offset]);
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -73,6 +145,8 @@ int disassemble_instruction(Chunk *chunk, int offset)
         return simple_instruction("OP_POP", offset);
     case OP_CONSTANT:
         return constant_instruction("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:
+        return constant_long_instruction("OP_CONSTANT_LONG", chunk, offset);
     case OP_NEGATE:
         return simple_instruction("OP_NEGATE", offset);
     // the arithmetic operators do take operands, so "+" has two operands
@@ -112,8 +186,98 @@ int disassemble_instruction(Chunk *chunk, int offset)
         return constant_instruction("OP_SET_GLOBAL", chunk, offset);
     case OP_SET_LOCAL:
         return byte_instruction("OP_SET_LOCAL", chunk, offset);
+    case OP_JUMP:
+        return jump_instruction("OP_JUMP", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE:
+        return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+        return jump_instruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+        return jump_instruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+        return jump_instruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_GREATER:
+        return jump_instruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_LESS:
+        return jump_instruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL:
+        return jump_instruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_EQUAL:
+        return jump_instruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+    case OP_LOOP:
+        return jump_instruction("OP_LOOP", -1, chunk, offset);
+    case OP_CALL:
+        return byte_instruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byte_instruction("OP_TAIL_CALL", chunk, offset);
+    case OP_CLOSURE:
+        return closure_instruction(chunk, offset);
+    case OP_GET_UPVALUE:
+        return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+    case OP_SET_UPVALUE:
+        return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_CLOSE_UPVALUE:
+        return simple_instruction("OP_CLOSE_UPVALUE", offset);
+    case OP_CLASS:
+        return constant_instruction("OP_CLASS", chunk, offset);
+    case OP_METHOD:
+        return constant_instruction("OP_METHOD", chunk, offset);
+    case OP_GET_PROPERTY:
+        return property_instruction("OP_GET_PROPERTY", chunk, offset);
+    case OP_SET_PROPERTY:
+        return property_instruction("OP_SET_PROPERTY", chunk, offset);
+    case OP_INVOKE:
+        return invoke_instruction("OP_INVOKE", chunk, offset);
+    case OP_INVOKE_THIS:
+        return invoke_instruction("OP_INVOKE_THIS", chunk, offset);
+    case OP_SUPER_INVOKE:
+        return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+    case OP_GET_SUPER:
+        return constant_instruction("OP_GET_SUPER", chunk, offset);
+    case OP_INHERIT:
+        return simple_instruction("OP_INHERIT", offset);
+    case OP_ADD_NUMBER:
+        return simple_instruction("OP_ADD_NUMBER", offset);
+    case OP_ADD_STRING:
+        return simple_instruction("OP_ADD_STRING", offset);
+    case OP_ADD_GENERIC:
+        return simple_instruction("OP_ADD_GENERIC", offset);
+    case OP_ADD_LL:
+        return register_instruction("OP_ADD_LL", chunk, offset, false, false);
+    case OP_ADD_LK:
+        return register_instruction("OP_ADD_LK", chunk, offset, false, true);
+    case OP_ADD_LL_TO:
+        return register_instruction("OP_ADD_LL_TO", chunk, offset, true, false);
+    case OP_ADD_LK_TO:
+        return register_instruction("OP_ADD_LK_TO", chunk, offset, true, true);
+    case OP_SUBTRACT_LL:
+        return register_instruction("OP_SUBTRACT_LL", chunk, offset, false, false);
+    case OP_SUBTRACT_LK:
+        return register_instruction("OP_SUBTRACT_LK", chunk, offset, false, true);
+    case OP_SUBTRACT_LL_TO:
+        return register_instruction("OP_SUBTRACT_LL_TO", chunk, offset, true, false);
+    case OP_SUBTRACT_LK_TO:
+        return register_instruction("OP_SUBTRACT_LK_TO", chunk, offset, true, true);
+    case OP_MULTIPLY_LL:
+        return register_instruction("OP_MULTIPLY_LL", chunk, offset, false, false);
+    case OP_MULTIPLY_LK:
+        return register_instruction("OP_MULTIPLY_LK", chunk, offset, false, true);
+    case OP_MULTIPLY_LL_TO:
+        return register_instruction("OP_MULTIPLY_LL_TO", chunk, offset, true, false);
+    case OP_MULTIPLY_LK_TO:
+        return register_instruction("OP_MULTIPLY_LK_TO", chunk, offset, true, true);
+    case OP_DIVIDE_LL:
+        return register_instruction("OP_DIVIDE_LL", chunk, offset, false, false);
+    case OP_DIVIDE_LK:
+        return register_instruction("OP_DIVIDE_LK", chunk, offset, false, true);
+    case OP_DIVIDE_LL_TO:
+        return register_instruction("OP_DIVIDE_LL_TO", chunk, offset, true, false);
+    case OP_DIVIDE_LK_TO:
+        return register_instruction("OP_DIVIDE_LK_TO", chunk, offset, true, true);
+    case OP_STORE_LOCAL:
+        return byte_instruction("OP_STORE_LOCAL", chunk, offset);
     default:
-        printf("Unknown code %d\n", instruction);
+        write_format("Unknown code %d\n", instruction);
         return offset + 1;
     }
 }
\ No newline at end of file
@@ -0,0 +1,337 @@
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include "jit.h"
+#include "memory.h"
+#include "output.h"
+#include "table.h"
+
+static bool jit_enabled = true;
+
+void set_jit_enabled(bool enabled)
+{
+    jit_enabled = enabled;
+}
+
+void free_jit(JitCode *jit)
+{
+    if (jit == NULL)
+        return;
+#if defined(__x86_64__) && defined(__linux__)
+    munmap(jit->code, jit->size);
+#endif
+    track_memory(MEM_JIT, jit->size, 0);
+    FREE_ARRAY(uint8_t *, jit->entries, jit->entry_count, MEM_JIT);
+    FREE(JitCode, jit, MEM_JIT);
+}
+
+// the runtime side of the machine code, which the stencils call. None of these report errors: if an
+// instruction fails, the machine code exits to the interpreter before it has any effect, and the
+// interpreter runs it again and reports the error, from the right line
+bool jit_add()
+{
+    if (!IS_STRING(vm.stack_top[-1]) || !IS_STRING(vm.stack_top[-2]))
+        return false;
+    concatenate();
+    return true;
+}
+
+void jit_print()
+{
+    print_value(pop());
+    write_line_end();
+}
+
+void jit_define_global(ObjString *name)
+{
+    table_set(&vm.globals, name, vm.stack_top[-1]);
+    pop();
+}
+
+bool jit_get_global(ObjString *name)
+{
+    Value value;
+    if (!table_get(&vm.globals, name, &value))
+        return false;
+    push(value);
+    return true;
+}
+
+bool jit_set_global(ObjString *name)
+{
+    Value value;
+    if (!table_get(&vm.globals, name, &value))
+        return false;
+    table_set(&vm.globals, name, vm.stack_top[-1]);
+    return true;
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+// the holes in the stencils, named after the JIT_* symbols in stencils.c. HOLE_CONTINUE and HOLE_JUMP are
+// jumps to the next instruction and to the jump target, HOLE_ADDRESS is anything in clox itself, e.g. a
+// runtime function or vm
+typedef enum
+{
+    HOLE_CONTINUE,
+    HOLE_JUMP,
+    HOLE_OPERAND_A,
+    HOLE_OPERAND_B,
+    HOLE_OPERAND_C,
+    HOLE_OFFSET,
+    HOLE_CONSTANTS,
+    HOLE_CACHES,
+    HOLE_ADDRESS,
+} StencilHole;
+
+// StencilPatch is a place in a stencil's code to patch: either a 64-bit absolute value, or a 32-bit
+// displacement relative to the end of the patch (for jumps and calls). addend is added to the value
+typedef struct
+{
+    int offset;
+    StencilHole hole;
+    bool relative;
+    int64_t addend;
+    const void *address;
+} StencilPatch;
+
+typedef struct
+{
+    const uint8_t *code;
+    size_t size;
+    const StencilPatch *patches;
+    int patch_count;
+    // the stencil's code ends by going on to the next instruction, which has to follow it
+    bool falls_through;
+} Stencil;
+
+// stencils.h is generated from stencils.c at build time, see the Makefile
+#include "stencils.h"
+
+// the machine code of an instruction is called with the frame, the stack top and the frame's slots, and
+// returns the offset of the instruction the interpreter has to run next
+typedef int (*JitEntry)(CallFrame *frame, Value *stack_top, Value *slots);
+
+// calls from the machine code into clox are too far away for a 32-bit displacement, so they go through a
+// trampoline at the end of the code: jmp [rip + 0] followed by the address
+#define TRAMPOLINE_SIZE 14
+// the most different runtime functions a function's machine code can call
+#define TRAMPOLINES_MAX 32
+
+static const Stencil *stencil_for(uint8_t instruction)
+{
+    if (instruction < sizeof(opcode_stencils) / sizeof(opcode_stencils[0]) && opcode_stencils[instruction] != NULL)
+        return opcode_stencils[instruction];
+    // calls, returns, closures and classes are the interpreter's
+    return &stencil_exit;
+}
+
+// jump_target is where the jump at offset lands, or -1 if it isn't a jump
+static int jump_target(Chunk *chunk, int offset)
+{
+    uint8_t instruction = chunk->code[offset];
+    if (instruction < OP_JUMP || instruction > OP_LOOP)
+        return -1;
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return instruction == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+// Stitcher keeps track of the copies of the stencils while jit_compile lays them out and patches them
+typedef struct
+{
+    ObjFunction *function;
+    uint8_t *code;
+    // where each instruction's code starts in code, -1 between instructions
+    int *native_offsets;
+    const void *trampolines[TRAMPOLINES_MAX];
+    int trampoline_count;
+    int trampolines_offset;
+} Stitcher;
+
+// trampoline returns the offset of the trampoline to address, adding one if there isn't one yet. It
+// returns -1 if there are too many
+static int trampoline(Stitcher *stitcher, const void *address)
+{
+    int i = 0;
+    while (i < stitcher->trampoline_count && stitcher->trampolines[i] != address)
+        i++;
+    if (i == TRAMPOLINES_MAX)
+        return -1;
+    if (i == stitcher->trampoline_count)
+        stitcher->trampolines[stitcher->trampoline_count++] = address;
+    return stitcher->trampolines_offset + i * TRAMPOLINE_SIZE;
+}
+
+// patch fills in the hole of one patch in the copy of the stencil of the instruction at offset
+static bool patch(Stitcher *stitcher, int offset, int length, const StencilPatch *patch)
+{
+    Chunk *chunk = &stitcher->function->chunk;
+    uint8_t *at = stitcher->code + stitcher->native_offsets[offset] + patch->offset;
+    uint64_t value;
+    int target;
+    switch (patch->hole)
+    {
+    case HOLE_CONTINUE:
+        target = offset + length;
+        if (target >= chunk->count)
+            return false;
+        value = (uint64_t)(stitcher->code + stitcher->native_offsets[target]);
+        break;
+    case HOLE_JUMP:
+        target = jump_target(chunk, offset);
+        if (target < 0 || target >= chunk->count || stitcher->native_offsets[target] < 0)
+            return false;
+        value = (uint64_t)(stitcher->code + stitcher->native_offsets[target]);
+        break;
+    case HOLE_OPERAND_A:
+    case HOLE_OPERAND_B:
+    case HOLE_OPERAND_C:
+    {
+        int operand = patch->hole - HOLE_OPERAND_A + 1;
+        value = operand < length ? chunk->code[offset + operand] : 0;
+        break;
+    }
+    case HOLE_OFFSET:
+        value = offset;
+        break;
+    case HOLE_CONSTANTS:
+        value = (uint64_t)chunk->constants.values;
+        break;
+    case HOLE_CACHES:
+        value = (uint64_t)stitcher->function->caches;
+        break;
+    case HOLE_ADDRESS:
+    {
+        value = (uint64_t)patch->address;
+        if (patch->relative)
+        {
+            int trampoline_offset = trampoline(stitcher, patch->address);
+            if (trampoline_offset < 0)
+                return false;
+            value = (uint64_t)(stitcher->code + trampoline_offset);
+        }
+        break;
+    }
+    default:
+        return false;
+    }
+
+    value += patch->addend;
+    if (!patch->relative)
+    {
+        memcpy(at, &value, sizeof(value));
+        return true;
+    }
+    int64_t displacement = (int64_t)(value - (uint64_t)at);
+    if (displacement != (int32_t)displacement)
+        return false;
+    int32_t displacement32 = (int32_t)displacement;
+    memcpy(at, &displacement32, sizeof(displacement32));
+    return true;
+}
+
+void jit_compile(ObjFunction *function)
+{
+    if (!jit_enabled)
+        return;
+
+    Chunk *chunk = &function->chunk;
+    Stitcher stitcher;
+    stitcher.function = function;
+    stitcher.trampoline_count = 0;
+    stitcher.native_offsets = ALLOCATE(int, chunk->count, MEM_JIT);
+    for (int i = 0; i < chunk->count; i++)
+        stitcher.native_offsets[i] = -1;
+
+    // lay out the stencils one after the other, and the trampolines after them
+    bool ok = true;
+    size_t size = 0;
+    int last = -1;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        int length = instruction_length(chunk, offset);
+        if (length == 0)
+        {
+            ok = false;
+            break;
+        }
+        stitcher.native_offsets[offset] = (int)size;
+        size += stencil_for(chunk->code[offset])->size;
+        last = offset;
+        offset += length;
+    }
+    // the last instruction has nothing to fall through to
+    if (last < 0 || stencil_for(chunk->code[last])->falls_through)
+        ok = false;
+    stitcher.trampolines_offset = (int)size;
+    size += TRAMPOLINES_MAX * TRAMPOLINE_SIZE;
+
+    // the code is written while the memory is writable, and then made executable, but it's never both
+    uint8_t *code = ok ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    stitcher.code = code;
+    for (int offset = 0; code != MAP_FAILED && offset < chunk->count;)
+    {
+        int length = instruction_length(chunk, offset);
+        const Stencil *stencil = stencil_for(chunk->code[offset]);
+        memcpy(code + stitcher.native_offsets[offset], stencil->code, stencil->size);
+        for (int i = 0; i < stencil->patch_count; i++)
+            ok = ok && patch(&stitcher, offset, length, &stencil->patches[i]);
+        offset += length;
+    }
+    for (int i = 0; code != MAP_FAILED && i < stitcher.trampoline_count; i++)
+    {
+        uint8_t *at = code + stitcher.trampolines_offset + i * TRAMPOLINE_SIZE;
+        static const uint8_t jump_indirect[] = {0xff, 0x25, 0x00, 0x00, 0x00, 0x00};
+        memcpy(at, jump_indirect, sizeof(jump_indirect));
+        memcpy(at + sizeof(jump_indirect), &stitcher.trampolines[i], sizeof(void *));
+    }
+    if (code != MAP_FAILED && (!ok || mprotect(code, size, PROT_READ | PROT_EXEC) != 0))
+    {
+        munmap(code, size);
+        code = MAP_FAILED;
+    }
+
+    if (code != MAP_FAILED)
+    {
+        JitCode *jit = ALLOCATE(JitCode, 1, MEM_JIT);
+        jit->code = code;
+        jit->size = size;
+        track_memory(MEM_JIT, 0, jit->size);
+        jit->entry_count = chunk->count;
+        jit->entries = ALLOCATE(uint8_t *, chunk->count, MEM_JIT);
+        for (int i = 0; i < chunk->count; i++)
+        {
+            bool enterable = stitcher.native_offsets[i] >= 0 && stencil_for(chunk->code[i]) != &stencil_exit;
+            jit->entries[i] = enterable ? code + stitcher.native_offsets[i] : NULL;
+        }
+        function->jit = jit;
+    }
+
+    FREE_ARRAY(int, stitcher.native_offsets, chunk->count, MEM_JIT);
+}
+
+void jit_run(CallFrame *frame)
+{
+    uint8_t *code = frame->function->chunk.code;
+    uint8_t *entry = frame->function->jit->entries[frame->ip - code];
+    if (entry == NULL)
+        return;
+
+    JitEntry enter = (JitEntry)entry;
+    frame->ip = code + enter(frame, vm.stack_top, frame->slots);
+}
+
+#else
+
+void jit_compile(ObjFunction *function)
+{
+}
+
+void jit_run(CallFrame *frame)
+{
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// a copy-and-patch JIT: once a function has been called or has looped JIT_THRESHOLD times, its bytecode is
+// translated into x86-64 machine code by copying a precompiled stencil for each instruction (see
+// stencils.c) and patching its operands in. The machine code keeps the VM's stack and locals exactly where
+// the interpreter keeps them, so the two can hand a frame back and forth at any instruction. Numbers take
+// fast paths, strings and globals call back into the runtime, and everything else (calls, returns,
+// classes, type errors etc.) exits to the interpreter, which runs the instruction itself. Only Linux on
+// x86-64 is supported, elsewhere functions just stay interpreted
+#define JIT_THRESHOLD 1000
+
+struct JitCode
+{
+    // code is the executable buffer
+    uint8_t *code;
+    size_t size;
+    // entries maps bytecode offsets to the machine code for the instruction there, which can be called
+    // as a function. It's NULL between instructions and for the instructions the interpreter has to run
+    uint8_t **entries;
+    int entry_count;
+};
+
+void set_jit_enabled(bool enabled);
+// jit_compile compiles function to machine code. If that's not possible, function->jit stays NULL
+void jit_compile(ObjFunction *function);
+// jit_run runs frame in machine code from frame->ip up to the first instruction the interpreter has
+// to run, and leaves frame->ip there. It does nothing if there's no machine code at frame->ip
+void jit_run(CallFrame *frame);
+void free_jit(JitCode *jit);
+
+// the runtime functions the machine code calls, see jit.c
+bool jit_add();
+void jit_print();
+void jit_define_global(ObjString *name);
+bool jit_get_global(ObjString *name);
+bool jit_set_global(ObjString *name);
+
+#endif
\ No newline at end of file
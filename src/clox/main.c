@@ -1,15 +1,31 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "chunk.h"
 #include "vm.h"
+#include "compiler.h"
+#include "jit.h"
 #include "debug.h"
+#include "memory.h"
+#include "output.h"
+
+// Source is the text of a script: either mapped straight from the file, or read into the heap
+typedef struct
+{
+    char *chars;
+    size_t length;
+    bool mapped;
+} Source;
 
 // read_file reads a file residing at path into heap-allocated memory and returns a pointer
 // to that memory. The caller has the responsibility of freeing the allocated memory subsequently.
-static char *read_file(const char *path)
+static char *read_file(const char *path, size_t *length)
 {
     FILE *file = fopen(path, "rb");
 
@@ -20,21 +36,42 @@ static char *read_file(const char *path)
     }
 
     // obtaining the size of the file, read the man pages to find out what these std library functions
-    // fseek, ftell and rewind do
-    fseek(file, 0L, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
+    // fseek, ftell and rewind do. Pipes (e.g. /dev/stdin) don't know their size up front though, so the
+    // size is only a first guess and the buffer grows if there turns out to be more to read
+    size_t capacity = 4096;
+    if (fseek(file, 0L, SEEK_END) == 0)
+    {
+        long file_size = ftell(file);
+        if (file_size > 0)
+            capacity = (size_t)file_size + 1;
+        rewind(file);
+    }
 
     // reading file into heap-allocated buffer
-    char *buffer = (char *)malloc(file_size + 1);
+    char *buffer = (char *)malloc(capacity);
     if (buffer == NULL)
     {
         fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
         exit(74);
     }
 
-    size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
-    if (bytes_read < file_size)
+    size_t bytes_read = 0;
+    for (;;)
+    {
+        // keep one byte for the terminator
+        bytes_read += fread(buffer + bytes_read, sizeof(char), capacity - bytes_read - 1, file);
+        if (bytes_read < capacity - 1)
+            break;
+
+        capacity *= 2;
+        buffer = (char *)realloc(buffer, capacity);
+        if (buffer == NULL)
+        {
+            fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+            exit(74);
+        }
+    }
+    if (ferror(file))
     {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
         exit(74);
@@ -42,60 +79,212 @@ static char *read_file(const char *path)
     buffer[bytes_read] = '\0';
 
     fclose(file);
+    *length = bytes_read;
     return buffer;
 }
 
-static void repl()
+// map_file maps a file read-only into memory, so the compiler scans the page cache directly:
+// no copy, and the pages aren't resident twice. It returns NULL for anything that can't be
+// mapped (pipes, empty files etc.), in which case the file has to be read instead
+static char *map_file(const char *path, size_t *length)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *chars = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps its own reference to the file
+    close(fd);
+    if (chars == MAP_FAILED)
+        return NULL;
+
+    // the scanner reads the source front to back exactly once
+    madvise(chars, st.st_size, MADV_SEQUENTIAL);
+    *length = st.st_size;
+    return chars;
+}
+
+static Source load_source(const char *path, bool use_mmap)
+{
+    Source source;
+    source.mapped = false;
+    if (use_mmap)
+    {
+        source.chars = map_file(path, &source.length);
+        source.mapped = source.chars != NULL;
+    }
+    if (!source.mapped)
+    {
+        source.chars = read_file(path, &source.length);
+    }
+    return source;
+}
+
+static void release_source(Source *source)
+{
+    if (source->mapped)
+        munmap(source->chars, source->length);
+    else
+        free(source->chars);
+}
+
+// report_suspended tells why the program stopped before it was done, its suspended run is simply dropped
+static void report_suspended()
+{
+    flush_output();
+    fprintf(stderr, vm.fuel <= 0 ? "Out of fuel.\n" : "Interrupted.\n");
+}
+
+// every line of the REPL gets the whole fuel budget, otherwise once it's used up, every later line that
+// loops or calls would be suspended straight away
+static void repl(int64_t fuel)
 {
     char line[1024];
     for (;;)
     {
-        printf("> ");
+        write_cstring("> ");
+        flush_output();
 
         if (!fgets(line, sizeof(line), stdin))
         // doesn't handle multi-line inputs gracefully
         // has hard-coded limit
         {
-            printf("\n");
+            write_char('\n');
             break;
         }
 
-        interpret(line);
+        set_fuel(fuel);
+        if (interpret(line, strlen(line)) == INTERPRET_SUSPENDED)
+            report_suspended();
     }
 }
 
-static void run_file(const char *path)
+// run_file returns the process exit code, so the caller gets a chance to report before exiting
+static int run_file(const char *path, bool use_mmap)
 {
-    char *source = read_file(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    Source source = load_source(path, use_mmap);
+    // the compiled program doesn't point into the source (strings are copied out of it), so it can
+    // be released as soon as it has been compiled, but it has to outlive the compiler
+    InterpretResult result = interpret(source.chars, source.length);
+    release_source(&source);
 
     if (result == INTERPRET_COMPILE_ERROR)
-        exit(65);
+        return 65;
     if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+        return 70;
+    if (result == INTERPRET_SUSPENDED)
+    {
+        report_suspended();
+        return 75;
+    }
+    return 0;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [--mem-stats] [--no-mmap] [--stack-only] [--no-jit] [--optimize] [--incremental-gc] "
+                    "[--heap-limit bytes[k|m|g]] [--fuel count] [--time-limit seconds] [path]\n");
+    exit(64);
+}
+
+static void on_time_limit(int signal)
+{
+    interrupt_vm();
+}
+
+// parse_size parses a size or count, with an optional k, m or g suffix, e.g. "64m"
+static size_t parse_size(const char *text)
+{
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (end == text)
+        usage();
+    // each suffix is 1024 times the next one
+    switch (*end)
+    {
+    case 'g':
+        size *= 1024;
+        // fall through
+    case 'm':
+        size *= 1024;
+        // fall through
+    case 'k':
+        size *= 1024;
+        end++;
+    }
+    if (*end != '\0')
+        usage();
+    return (size_t)size;
 }
 
 int main(int argc, const char *argv[])
 {
+    const char *path = NULL;
+    bool show_mem_stats = false;
+    bool use_mmap = true;
+    size_t heap_limit = 0;
+    int64_t fuel = FUEL_UNLIMITED;
+    unsigned int time_limit = 0;
 
-    init_vm();
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--mem-stats") == 0)
+            show_mem_stats = true;
+        else if (strcmp(argv[i], "--no-mmap") == 0)
+            use_mmap = false;
+        else if (strcmp(argv[i], "--stack-only") == 0)
+            set_register_ops(false);
+        else if (strcmp(argv[i], "--no-jit") == 0)
+            set_jit_enabled(false);
+        else if (strcmp(argv[i], "--optimize") == 0)
+            set_optimize(true);
+        else if (strcmp(argv[i], "--incremental-gc") == 0)
+            set_incremental_gc(true);
+        else if (strcmp(argv[i], "--heap-limit") == 0 && i + 1 < argc)
+            heap_limit = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc)
+            fuel = (int64_t)parse_size(argv[++i]);
+        else if (strcmp(argv[i], "--time-limit") == 0 && i + 1 < argc)
+            time_limit = (unsigned int)parse_size(argv[++i]);
+        else if (argv[i][0] == '-' || path != NULL)
+            usage();
+        else
+            path = argv[i];
+    }
 
-    if (argc == 1)
+    init_vm();
+    set_heap_limit(heap_limit);
+    set_fuel(fuel);
+    // the timer doesn't stop the program itself, it interrupts it at its next loop or call
+    if (time_limit > 0)
     {
-        repl();
+        signal(SIGALRM, on_time_limit);
+        alarm(time_limit);
     }
-    else if (argc == 2)
+
+    int exit_code = 0;
+    if (path == NULL)
     {
-        run_file(argv[1]);
+        repl(fuel);
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        exit_code = run_file(path, use_mmap);
     }
 
+    // report before tearing down the VM, so "current" shows what was still live at exit
+    flush_output();
+    if (show_mem_stats)
+        print_mem_stats(stderr);
+
     free_vm();
 
-    return 0;
+    return exit_code;
 }
\ No newline at end of file
@@ -1,9 +1,163 @@
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "memory.h"
 #include "vm.h"
+#include "jit.h"
 
-void *reallocate(void *pointer, size_t old_size, size_t new_size)
+static MemStats mem_stats;
+
+static inline bool over_heap_limit()
+{
+    return vm.heap_limit > 0 && mem_stats.bytes_current > vm.heap_limit;
+}
+
+// request_collection has the program start a collection at its next safepoint
+static inline void request_collection()
+{
+    vm.gc_requested = true;
+    vm.safepoint_requested = true;
+}
+
+static int size_class(size_t size)
+{
+    int bucket = 0;
+    while (size > 1 && bucket < MEM_HISTOGRAM_BUCKETS - 1)
+    {
+        size >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void track_memory(MemCategory category, size_t old_size, size_t new_size)
+{
+    MemCategoryStats *stats = &mem_stats.categories[category];
+
+    if (old_size == 0 && new_size == 0)
+        return;
+    if (old_size == 0)
+        stats->allocations++;
+    else if (new_size == 0)
+        stats->frees++;
+    else
+        stats->reallocations++;
+    if (new_size > 0)
+        stats->histogram[size_class(new_size)]++;
+
+    // sizes are unsigned, so apply the delta in two steps rather than computing new - old
+    stats->bytes_current = stats->bytes_current - old_size + new_size;
+    mem_stats.bytes_current = mem_stats.bytes_current - old_size + new_size;
+    if (stats->bytes_current > stats->bytes_peak)
+        stats->bytes_peak = stats->bytes_current;
+    if (mem_stats.bytes_current > mem_stats.bytes_peak)
+        mem_stats.bytes_peak = mem_stats.bytes_current;
+}
+
+const MemStats *get_mem_stats()
+{
+    return &mem_stats;
+}
+
+// reset_mem_stats clears the counters, but keeps the current byte counts since those blocks are
+// still live and will be freed later; the peaks restart from the current usage
+void reset_mem_stats()
+{
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
+    {
+        MemCategoryStats *stats = &mem_stats.categories[i];
+        size_t current = stats->bytes_current;
+        memset(stats, 0, sizeof(MemCategoryStats));
+        stats->bytes_current = current;
+        stats->bytes_peak = current;
+    }
+    mem_stats.bytes_peak = mem_stats.bytes_current;
+}
+
+const char *mem_category_name(MemCategory category)
+{
+    switch (category)
+    {
+    case MEM_CHUNK_CODE:
+        return "chunk code";
+    case MEM_CHUNK_LINES:
+        return "chunk lines";
+    case MEM_CONSTANTS:
+        return "constants";
+    case MEM_TABLE_ENTRIES:
+        return "table entries";
+    case MEM_STRING_SET:
+        return "string set";
+    case MEM_STRING_HEADERS:
+        return "string headers";
+    case MEM_STRING_CHARS:
+        return "string chars";
+    case MEM_FUNCTIONS:
+        return "functions";
+    case MEM_CLOSURES:
+        return "closures";
+    case MEM_CLASSES:
+        return "classes";
+    case MEM_INSTANCES:
+        return "instances";
+    case MEM_JIT:
+        return "jit code";
+    case MEM_ARENA:
+        return "arena";
+    case MEM_GC:
+        return "gc";
+    default:
+        return "unknown";
+    }
+}
+
+void print_mem_stats(FILE *out)
+{
+    fprintf(out, "== memory stats ==\n");
+    fprintf(out, "%-16s %12s %12s %10s %10s %10s\n", "category", "current", "peak", "allocs", "reallocs", "frees");
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
+    {
+        MemCategoryStats *stats = &mem_stats.categories[i];
+        fprintf(out, "%-16s %12zu %12zu %10zu %10zu %10zu\n", mem_category_name((MemCategory)i),
+                stats->bytes_current, stats->bytes_peak, stats->allocations, stats->reallocations, stats->frees);
+    }
+    // the total peak isn't the sum of the category peaks, since they don't necessarily happen at the same time
+    fprintf(out, "%-16s %12zu %12zu\n", "total", mem_stats.bytes_current, mem_stats.bytes_peak);
+    fprintf(out, "gc cycles: %zu\n", vm.gc_cycles);
+
+    fprintf(out, "== size histogram (requested bytes) ==\n");
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
+    {
+        MemCategoryStats *stats = &mem_stats.categories[i];
+        bool printed_name = false;
+        for (int bucket = 0; bucket < MEM_HISTOGRAM_BUCKETS; bucket++)
+        {
+            if (stats->histogram[bucket] == 0)
+                continue;
+            if (!printed_name)
+            {
+                fprintf(out, "%s\n", mem_category_name((MemCategory)i));
+                printed_name = true;
+            }
+            char size_range[48];
+            if (bucket == MEM_HISTOGRAM_BUCKETS - 1)
+                snprintf(size_range, sizeof(size_range), ">= %zu", (size_t)1 << bucket);
+            else
+                snprintf(size_range, sizeof(size_range), "[%zu, %zu)", (size_t)1 << bucket, (size_t)1 << (bucket + 1));
+            fprintf(out, "  %-22s %10zu\n", size_range, stats->histogram[bucket]);
+        }
+    }
+}
+
+void *reallocate(void *pointer, size_t old_size, size_t new_size, MemCategory category)
 {
+    track_memory(category, old_size, new_size);
+    // the allocation goes ahead, whoever asked for it isn't ready for it to fail. The program gets its
+    // "Out of memory." at the next safepoint, if a collection can't get the heap back under the limit
+    if (new_size > old_size && over_heap_limit())
+        request_collection();
+
     if (new_size == 0)
     {
         // notice we don't need to pass how much memory to free
@@ -30,25 +184,400 @@ void *reallocate(void *pointer, size_t old_size, size_t new_size)
 
 static void free_object(Obj *object)
 {
-    switch (object->type)
+    switch (obj_type(object))
     {
     case OBJ_STRING:
     {
         ObjString *string = (ObjString *)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+        if (obj_flag(object, STRING_INTERNED))
+            string_set_remove(&vm.strings, string);
+        FREE_ARRAY(char, string->chars, string->length + 1, MEM_STRING_CHARS);
+        FREE(ObjString, object, MEM_STRING_HEADERS);
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        // the function's name is a string object of its own, freed on its own
+        ObjFunction *function = (ObjFunction *)object;
+        free_chunk(&function->chunk);
+        FREE_ARRAY(PropertyCache, function->caches, function->cache_count, MEM_FUNCTIONS);
+        FREE_ARRAY(MethodCache, function->method_caches, function->method_cache_count, MEM_FUNCTIONS);
+        free_jit(function->jit);
+        FREE(ObjFunction, object, MEM_FUNCTIONS);
+        break;
+    }
+    case OBJ_NATIVE:
+        FREE(ObjNative, object, MEM_FUNCTIONS);
+        break;
+    case OBJ_CLOSURE:
+    {
+        // the closure doesn't own its function, nor the upvalues, which other closures may share
+        ObjClosure *closure = (ObjClosure *)object;
+        FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalue_count, MEM_CLOSURES);
+        FREE(ObjClosure, object, MEM_CLOSURES);
+        break;
+    }
+    case OBJ_UPVALUE:
+        FREE(ObjUpvalue, object, MEM_CLOSURES);
+        break;
+    case OBJ_CLASS:
+    {
+        ObjClass *klass = (ObjClass *)object;
+        free_table(&klass->methods);
+        FREE(ObjClass, object, MEM_CLASSES);
+        break;
+    }
+    case OBJ_INSTANCE:
+    {
+        ObjInstance *instance = (ObjInstance *)object;
+        FREE_ARRAY(Value, instance->fields, instance->capacity, MEM_INSTANCES);
+        FREE(ObjInstance, object, MEM_INSTANCES);
+        break;
+    }
+    case OBJ_BOUND_METHOD:
+        FREE(ObjBoundMethod, object, MEM_CLASSES);
+        break;
+    case OBJ_SHAPE:
+    {
+        Shape *shape = (Shape *)object;
+        FREE_ARRAY(ObjString *, shape->field_names, shape->field_count, MEM_CLASSES);
+        free_table(&shape->transitions);
+        FREE(Shape, object, MEM_CLASSES);
         break;
     }
     }
 }
 
-void free_objects()
+static void free_list(Obj *object)
 {
-    Obj *object = vm.objects;
     while (object != NULL)
     {
-        Obj *next = object->next;
+        Obj *next = obj_next(object);
         free_object(object);
         object = next;
     }
+}
+
+void free_objects()
+{
+    free_list(vm.objects);
+    free_list(vm.unswept);
+    vm.objects = NULL;
+    vm.unswept = NULL;
+    FREE_ARRAY(Obj *, vm.gray_stack, vm.gray_capacity, MEM_GC);
+    vm.gray_stack = NULL;
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+}
+
+// the collector is a plain mark-sweep collector, which either does a whole collection at once (stop the
+// world), or does most of it incrementally, interleaved with the program:
+// - a collection starts at a safepoint, where it marks the roots: the stack, the frames, the open upvalues
+//   and the globals. That's the only part that has to happen at once, it's as long as the stack is deep
+// - then every new object pays for itself with a slice of marking, until there are no gray objects left.
+//   Meanwhile the write barrier marks what the program overwrites in the heap (see write_barrier), so
+//   everything that was reachable at the start gets marked. New objects are born marked
+// - then the objects that were there at the start are swept, a few more at every new object, and the
+//   collection is over once they all are. Interned strings are weak: the dead ones are taken out of
+//   vm.strings as they're freed, and one that's looked up again before then is marked (see copy_string)
+// Marking and sweeping happen on the program's own thread: the VM's objects change without any locking
+// (e.g. instance_reserve_fields moves the fields of an instance), so another thread couldn't safely scan
+// them while the program runs
+
+static bool incremental_gc = false;
+
+// the heap can grow to this much before the first collection, and then to GC_HEAP_GROW_FACTOR times
+// what the last collection left
+#define GC_INITIAL_HEAP (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+// every byte allocated while marking pays for scanning GC_MARK_RATE bytes of marked objects, so marking
+// is over before the heap has grown by a fraction of what's live
+#define GC_MARK_RATE 4
+// and every new object while sweeping pays for sweeping this many old ones
+#define GC_SWEEP_RATE 32
+
+void init_gc()
+{
+    vm.gc_phase = GC_IDLE;
+    vm.gc_requested = false;
+    vm.next_gc = GC_INITIAL_HEAP;
+    vm.gc_black = false;
+    vm.gray_stack = NULL;
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+    vm.unswept = NULL;
+    vm.gc_cycles = 0;
+    vm.heap_limit = 0;
+}
+
+void set_incremental_gc(bool incremental)
+{
+    incremental_gc = incremental;
+}
+
+static inline bool is_marked(Obj *object)
+{
+    return (obj_flag(object, OBJ_MARKED) != 0) == vm.gc_black;
+}
+
+static inline void set_marked(Obj *object)
+{
+    if (vm.gc_black)
+        set_obj_flag(object, OBJ_MARKED);
+    else
+        clear_obj_flag(object, OBJ_MARKED);
+}
+
+static void mark_object(Obj *object)
+{
+    if (object == NULL || is_marked(object))
+        return;
+    set_marked(object);
+    // strings and natives don't refer to anything, so they're done right away
+    if (obj_type(object) == OBJ_STRING || obj_type(object) == OBJ_NATIVE)
+        return;
+
+    if (vm.gray_count == vm.gray_capacity)
+    {
+        int capacity = vm.gray_capacity;
+        vm.gray_capacity = GROW_CAPACITY(capacity);
+        vm.gray_stack = GROW_ARRAY(Obj *, vm.gray_stack, capacity, vm.gray_capacity, MEM_GC);
+    }
+    vm.gray_stack[vm.gray_count++] = object;
+}
+
+static inline void mark_value(Value value)
+{
+    if (IS_OBJ(value))
+        mark_object(AS_OBJ(value));
+}
+
+static void mark_table(Table *table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry *entry = &table->entries[i];
+        mark_object((Obj *)entry->key);
+        mark_value(entry->value);
+    }
+}
+
+void gc_shade(Obj *object)
+{
+    if (vm.gc_phase != GC_IDLE)
+        mark_object(object);
+}
+
+// blacken marks everything a gray object refers to. It returns about how many bytes it looked at, which
+// is what a slice of marking is measured in
+static size_t blacken(Obj *object)
+{
+    switch (obj_type(object))
+    {
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)object;
+        mark_object((Obj *)function->name);
+        for (int i = 0; i < function->chunk.constants.count; i++)
+            mark_value(function->chunk.constants.values[i]);
+        // the caches hold on to what they remember, it's as much as a few shapes per site
+        for (int i = 0; i < function->cache_count; i++)
+        {
+            PropertyCache *cache = &function->caches[i];
+            for (int j = 0; j < cache->count; j++)
+            {
+                mark_object((Obj *)cache->entries[j].shape);
+                mark_object((Obj *)cache->entries[j].transition);
+            }
+        }
+        for (int i = 0; i < function->method_cache_count; i++)
+        {
+            MethodCache *cache = &function->method_caches[i];
+            for (int j = 0; j < cache->count; j++)
+            {
+                mark_object((Obj *)cache->entries[j].key);
+                mark_value(cache->entries[j].method);
+            }
+        }
+        return sizeof(ObjFunction) + function->chunk.constants.count * sizeof(Value) +
+               function->cache_count * sizeof(PropertyCache) + function->method_cache_count * sizeof(MethodCache);
+    }
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)object;
+        mark_object((Obj *)closure->function);
+        // a closure's upvalues are NULL until OP_CLOSURE has captured them
+        for (int i = 0; i < closure->upvalue_count; i++)
+            mark_object((Obj *)closure->upvalues[i]);
+        return sizeof(ObjClosure) + closure->upvalue_count * sizeof(ObjUpvalue *);
+    }
+    case OBJ_UPVALUE:
+        // an open upvalue's closed is nil, its variable is on the stack
+        mark_value(((ObjUpvalue *)object)->closed);
+        return sizeof(ObjUpvalue);
+    case OBJ_CLASS:
+    {
+        ObjClass *klass = (ObjClass *)object;
+        mark_object((Obj *)klass->name);
+        mark_object((Obj *)klass->root_shape);
+        mark_table(&klass->methods);
+        return sizeof(ObjClass) + klass->methods.capacity * sizeof(Entry);
+    }
+    case OBJ_INSTANCE:
+    {
+        ObjInstance *instance = (ObjInstance *)object;
+        mark_object((Obj *)instance->klass);
+        mark_object((Obj *)instance->shape);
+        // the fields beyond the shape's aren't in use
+        for (int i = 0; i < instance->shape->field_count; i++)
+            mark_value(instance->fields[i]);
+        return sizeof(ObjInstance) + instance->shape->field_count * sizeof(Value);
+    }
+    case OBJ_BOUND_METHOD:
+    {
+        ObjBoundMethod *bound = (ObjBoundMethod *)object;
+        mark_value(bound->receiver);
+        mark_value(bound->method);
+        return sizeof(ObjBoundMethod);
+    }
+    case OBJ_SHAPE:
+    {
+        Shape *shape = (Shape *)object;
+        mark_object((Obj *)shape->parent);
+        for (int i = 0; i < shape->field_count; i++)
+            mark_object((Obj *)shape->field_names[i]);
+        mark_table(&shape->transitions);
+        return sizeof(Shape) + shape->field_count * sizeof(ObjString *) + shape->transitions.capacity * sizeof(Entry);
+    }
+    default:
+        return 0;
+    }
+}
+
+static void mark_roots()
+{
+    for (Value *slot = vm.stack; slot < vm.stack_top; slot++)
+        mark_value(*slot);
+    // a frame's closure is in its slot zero, or a method of a class
+    for (int i = 0; i < vm.frame_count; i++)
+        mark_object((Obj *)vm.frames[i].function);
+    for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next)
+        mark_object((Obj *)upvalue);
+    mark_table(&vm.globals);
+    mark_object((Obj *)vm.init_string);
+}
+
+// sweep_step sweeps up to count objects, and returns whether there are any left
+static bool sweep_step(int count)
+{
+    while (vm.unswept != NULL && count-- > 0)
+    {
+        Obj *object = vm.unswept;
+        vm.unswept = obj_next(object);
+        if (is_marked(object))
+        {
+            set_obj_next(object, vm.objects);
+            vm.objects = object;
+        }
+        else
+        {
+            free_object(object);
+        }
+    }
+    if (vm.unswept != NULL)
+        return true;
+
+    vm.gc_phase = GC_IDLE;
+    vm.next_gc = mem_stats.bytes_current * GC_HEAP_GROW_FACTOR;
+    if (vm.next_gc < GC_INITIAL_HEAP)
+        vm.next_gc = GC_INITIAL_HEAP;
+    // with a limit, the heap never gets past it without a collection first
+    if (vm.heap_limit > 0 && vm.next_gc > vm.heap_limit)
+        vm.next_gc = vm.heap_limit;
+    return false;
+}
+
+// mark_step blackens gray objects for about budget bytes. Once there are none left, everything reachable
+// is marked, and the objects that were there before the sweep starts are the ones to sweep
+static void mark_step(size_t budget)
+{
+    size_t done = 0;
+    while (vm.gray_count > 0 && done < budget)
+        done += blacken(vm.gray_stack[--vm.gray_count]);
+    if (vm.gray_count > 0)
+        return;
+
+    vm.gc_phase = GC_SWEEPING;
+    vm.unswept = vm.objects;
+    vm.objects = NULL;
+}
+
+static void start_collection()
+{
+    vm.gc_cycles++;
+    // flipping what the mark bit means unmarks every object at once
+    vm.gc_black = !vm.gc_black;
+    vm.gc_phase = GC_MARKING;
+    mark_roots();
+}
+
+// finish_collection does what's left of the ongoing collection at once. Unlike starting one, that's safe
+// anywhere: it only frees what was already unreachable when the collection started
+static void finish_collection()
+{
+    if (vm.gc_phase == GC_MARKING)
+        mark_step(SIZE_MAX);
+    while (vm.gc_phase == GC_SWEEPING)
+        sweep_step(INT_MAX);
+}
+
+bool collect_garbage()
+{
+    vm.gc_requested = false;
+    bool started = vm.gc_phase == GC_IDLE;
+    if (started)
+        start_collection();
+    if (!incremental_gc)
+        finish_collection();
+    if (!over_heap_limit())
+        return true;
+
+    // over the limit, the collection can't be left for later. One that started before this safepoint may
+    // have missed garbage made since, so then there's a whole one from here
+    finish_collection();
+    if (!started && over_heap_limit())
+    {
+        start_collection();
+        finish_collection();
+    }
+    return !over_heap_limit();
+}
+
+void set_heap_limit(size_t limit)
+{
+    vm.heap_limit = limit;
+    if (limit > 0 && vm.next_gc > limit)
+        vm.next_gc = limit;
+}
+
+void gc_allocated(Obj *object, size_t size)
+{
+    set_marked(object);
+#ifdef DEBUG_STRESS_GC
+    request_collection();
+#endif
+
+    switch (vm.gc_phase)
+    {
+    case GC_IDLE:
+        if (mem_stats.bytes_current > vm.next_gc)
+            request_collection();
+        break;
+    case GC_MARKING:
+        mark_step(size * GC_MARK_RATE);
+        break;
+    case GC_SWEEPING:
+        sweep_step(GC_SWEEP_RATE);
+        break;
+    }
 }
\ No newline at end of file
@@ -1,28 +1,107 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
-void *reallocate(void *pointer, size_t old_size, size_t new_size);
+// MemCategory tags every allocation that goes through reallocate, so we can tell where
+// the heap is going: code vs line info vs constants vs strings etc.
+typedef enum
+{
+    MEM_CHUNK_CODE,
+    MEM_CHUNK_LINES,
+    MEM_CONSTANTS,
+    MEM_TABLE_ENTRIES,
+    MEM_STRING_SET,
+    MEM_STRING_HEADERS,
+    MEM_STRING_CHARS,
+    MEM_FUNCTIONS,
+    MEM_CLOSURES,
+    MEM_CLASSES,
+    MEM_INSTANCES,
+    MEM_JIT,
+    MEM_ARENA,
+    MEM_GC,
+    MEM_CATEGORY_COUNT
+} MemCategory;
+
+// size histogram buckets are power-of-two size classes: bucket i counts requests of
+// [2^i, 2^(i+1)) bytes, and the last bucket also collects everything bigger than that
+#define MEM_HISTOGRAM_BUCKETS 24
+
+typedef struct
+{
+    size_t bytes_current;
+    size_t bytes_peak;
+    // allocations counts fresh blocks, reallocations counts resizes of live blocks (e.g. growing
+    // a dynamic array) and frees counts blocks handed back
+    size_t allocations;
+    size_t reallocations;
+    size_t frees;
+    size_t histogram[MEM_HISTOGRAM_BUCKETS];
+} MemCategoryStats;
+
+typedef struct
+{
+    MemCategoryStats categories[MEM_CATEGORY_COUNT];
+    size_t bytes_current;
+    size_t bytes_peak;
+} MemStats;
+
+void *reallocate(void *pointer, size_t old_size, size_t new_size, MemCategory category);
 void free_objects();
 
+// GCPhase is where the garbage collector is in a collection. A collection starts at a safepoint, marks
+// what's reachable and then sweeps the rest. By default it does all of that at once, in the incremental
+// mode it only takes the roots at the safepoint, and marking and sweeping go on a bit at every allocation
+typedef enum
+{
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} GCPhase;
+
+void init_gc();
+void set_incremental_gc(bool incremental);
+// set_heap_limit caps what the VM's heap can grow to, in bytes, 0 for no limit. The limit covers everything
+// that goes through reallocate, but the compiler is allowed past it
+void set_heap_limit(size_t limit);
+// collect_garbage starts a collection. It's only called at a safepoint, see run(), where everything the
+// program can still get to is reachable from the VM's roots. It returns false if the heap is over its
+// limit even after a full collection
+bool collect_garbage();
+// gc_allocated is told about every new object, which it counts as live in the ongoing collection and pays
+// for with a slice of the collector's work
+void gc_allocated(Obj *object, size_t size);
+// gc_shade marks object, while a collection is marking or sweeping, see write_barrier
+void gc_shade(Obj *object);
+
+// track_memory records a change in the size of a block of memory without allocating it, for memory
+// clox holds that doesn't come from reallocate (e.g. the VM stack, which is embedded in the VM struct)
+void track_memory(MemCategory category, size_t old_size, size_t new_size);
+const MemStats *get_mem_stats();
+void reset_mem_stats();
+const char *mem_category_name(MemCategory category);
+void print_mem_stats(FILE *out);
+
 // OK to waste some space for smaller arrays, at the benefit of having to allocate and copy
 // fewer times when initially growing
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity)*2)
 
 // some generics / template programming on types
-#define GROW_ARRAY(type, pointer, old_count, new_count) \
-    (type *)reallocate(pointer, sizeof(type) * (old_count), sizeof(type) * (new_count))
+#define GROW_ARRAY(type, pointer, old_count, new_count, category) \
+    (type *)reallocate(pointer, sizeof(type) * (old_count), sizeof(type) * (new_count), category)
 
-#define FREE_ARRAY(type, pointer, capacity) \
-    reallocate(pointer, sizeof(type) * (capacity), 0);
+#define FREE_ARRAY(type, pointer, capacity, category) \
+    reallocate(pointer, sizeof(type) * (capacity), 0, category);
 
-#define ALLOCATE(type, count) \
-    (type *)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(type, count, category) \
+    (type *)reallocate(NULL, 0, sizeof(type) * (count), category)
 
-#define FREE(type, pointer) \
-    reallocate(pointer, sizeof(type), 0)
+#define FREE(type, pointer, category) \
+    reallocate(pointer, sizeof(type), 0, category)
 
 #endif
\ No newline at end of file
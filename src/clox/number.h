@@ -0,0 +1,13 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+// the longest number format_number produces is something like "-1.2345678901234567e-308"
+#define NUMBER_BUFFER_SIZE 32
+
+int format_number(double value, char *buffer);
+bool decimal_to_double(uint64_t significand, int exponent, double *value);
+double parse_number(const char *chars, int length);
+
+#endif
\ No newline at end of file
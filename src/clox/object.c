@@ -1,35 +1,182 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, object_type) \
-    (type *)allocate_object(sizeof(type), object_type)
+#define ALLOCATE_OBJ(type, object_type, category) \
+    (type *)allocate_object(sizeof(type), object_type, category)
 
-static Obj *allocate_object(size_t size, ObjType type)
+static Obj *allocate_object(size_t size, ObjType type, MemCategory category)
 {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
-    object->type = type;
-    object->next = vm.objects;
+    Obj *object = (Obj *)reallocate(NULL, 0, size, category);
+    // the header has no room for an address above 48 bits, which no platform clox runs on hands out
+    if ((uintptr_t)object > OBJ_NEXT_MASK)
+    {
+        fprintf(stderr, "Object address doesn't fit in the object header.\n");
+        exit(1);
+    }
+    object->header = (uint64_t)type << OBJ_TYPE_SHIFT;
+    set_obj_next(object, vm.objects);
     vm.objects = object;
+    gc_allocated(object, size);
     return object;
 }
 
-static ObjString *allocate_string(char *chars, int length, uint32_t hash)
+static ObjString *allocate_string(char *chars, int length, uint32_t hash, bool interned)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING, MEM_STRING_HEADERS);
     string->length = length;
+    if (interned)
+        set_obj_flag(&string->obj, STRING_INTERNED | STRING_HASHED);
     string->chars = chars;
     string->hash = hash;
-    table_set(&vm.strings, string, NIL_VAL);
+    if (interned)
+        string_set_add(&vm.strings, string);
 
     return string;
 }
 
+ObjFunction *new_function()
+{
+    ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION, MEM_FUNCTIONS);
+    function->arity = 0;
+    function->upvalue_count = 0;
+    function->max_stack = 0;
+    function->name = NULL;
+    function->caches = NULL;
+    function->cache_count = 0;
+    function->method_caches = NULL;
+    function->method_cache_count = 0;
+    function->hotness = 0;
+    function->jit = NULL;
+    init_chunk(&function->chunk);
+    return function;
+}
+
+ObjNative *new_native(NativeFn function, int arity)
+{
+    ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE, MEM_FUNCTIONS);
+    native->function = function;
+    native->arity = arity;
+    return native;
+}
+
+ObjClosure *new_closure(ObjFunction *function)
+{
+    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalue_count, MEM_CLOSURES);
+    for (int i = 0; i < function->upvalue_count; i++)
+    {
+        upvalues[i] = NULL;
+    }
+
+    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE, MEM_CLOSURES);
+    closure->function = function;
+    closure->upvalues = upvalues;
+    closure->upvalue_count = function->upvalue_count;
+    return closure;
+}
+
+ObjUpvalue *new_upvalue(Value *slot)
+{
+    ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE, MEM_CLOSURES);
+    upvalue->location = slot;
+    upvalue->closed = NIL_VAL;
+    upvalue->next = NULL;
+    return upvalue;
+}
+
+static Shape *new_shape(Shape *parent, ObjString *name)
+{
+    Shape *shape = ALLOCATE_OBJ(Shape, OBJ_SHAPE, MEM_CLASSES);
+    shape->parent = parent;
+    shape->field_names = NULL;
+    shape->field_count = parent == NULL ? 0 : parent->field_count + 1;
+    init_table(&shape->transitions);
+    if (shape->field_count > 0)
+    {
+        // every shape has its own copy of the names, objects are small so the chains are short
+        shape->field_names = ALLOCATE(ObjString *, shape->field_count, MEM_CLASSES);
+        // the root shape has no names to copy, and memcpy from its NULL array is undefined even for 0 bytes
+        if (parent->field_count > 0)
+            memcpy(shape->field_names, parent->field_names, parent->field_count * sizeof(ObjString *));
+        shape->field_names[shape->field_count - 1] = name;
+    }
+    return shape;
+}
+
+ObjClass *new_class(ObjString *name)
+{
+    ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS, MEM_CLASSES);
+    klass->name = name;
+    init_table(&klass->methods);
+    klass->field_capacity = 0;
+    klass->root_shape = new_shape(NULL, NULL);
+    return klass;
+}
+
+ObjInstance *new_instance(ObjClass *klass)
+{
+    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE, MEM_INSTANCES);
+    instance->klass = klass;
+    instance->shape = klass->root_shape;
+    instance->capacity = klass->field_capacity;
+    instance->fields = ALLOCATE(Value, instance->capacity, MEM_INSTANCES);
+    return instance;
+}
+
+ObjBoundMethod *new_bound_method(Value receiver, Value method)
+{
+    ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD, MEM_CLASSES);
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
+}
+
+// shape_find_field returns the index of the field called name, or -1 if shape doesn't have it. Names are
+// interned, so comparing pointers is enough
+int shape_find_field(Shape *shape, ObjString *name)
+{
+    for (int i = shape->field_count - 1; i >= 0; i--)
+    {
+        if (shape->field_names[i] == name)
+            return i;
+    }
+    return -1;
+}
+
+// shape_transition returns the shape of an instance of shape that gets a new field called name
+Shape *shape_transition(Shape *shape, ObjString *name)
+{
+    Value child;
+    if (table_get(&shape->transitions, name, &child))
+        return (Shape *)AS_OBJ(child);
+
+    Shape *created = new_shape(shape, name);
+    table_set(&shape->transitions, name, OBJ_VAL(created));
+    return created;
+}
+
+// instance_reserve_fields makes room for count fields in instance
+void instance_reserve_fields(ObjInstance *instance, int count)
+{
+    if (count > instance->klass->field_capacity)
+        instance->klass->field_capacity = count;
+    if (count <= instance->capacity)
+        return;
+
+    int capacity = instance->capacity < 4 ? 4 : instance->capacity * 2;
+    if (capacity < count)
+        capacity = count;
+    instance->fields = GROW_ARRAY(Value, instance->fields, instance->capacity, capacity, MEM_INSTANCES);
+    instance->capacity = capacity;
+}
+
 // FNV-1a hash function
 uint32_t hash_string(const char *chars, int length)
 {
@@ -48,31 +195,63 @@ uint32_t hash_string(const char *chars, int length)
 ObjString *copy_string(const char *chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
-    ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString *interned = string_set_find(&vm.strings, chars, length, hash);
     if (interned != NULL)
+    {
+        // vm.strings doesn't keep its strings alive, so one the collector hasn't marked yet would be freed
+        // under the program if it didn't get marked now
+        gc_shade(&interned->obj);
         return interned;
+    }
 
     // new unique string, add it to the collection of interned strings
-    char *heap_chars = ALLOCATE(char, length + 1);
+    char *heap_chars = ALLOCATE(char, length + 1, MEM_STRING_CHARS);
     memcpy(heap_chars, chars, length);
     heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    return allocate_string(heap_chars, length, hash, true);
 }
 
 // take_string takes ownership of the heap-allocated character array that's passed in, and allocates
 // a Lox string pointing to chars
 ObjString *take_string(char *chars, int length)
 {
+    if (length > INTERN_MAX_LENGTH)
+        return allocate_string(chars, length, 0, false);
+
     uint32_t hash = hash_string(chars, length);
-    ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString *interned = string_set_find(&vm.strings, chars, length, hash);
     if (interned != NULL)
     {
+        gc_shade(&interned->obj);
         // ownership is passed to this function, and it no longer needs the passed in string, so just free it up
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(char, chars, length + 1, MEM_STRING_CHARS);
         return interned;
     }
     // new unique string, add it to the collection of interned strings
-    return allocate_string(chars, length, hash);
+    return allocate_string(chars, length, hash, true);
+}
+
+// string_hash is the hash of string, which strings that aren't interned only compute when it's needed
+uint32_t string_hash(ObjString *string)
+{
+    if (!obj_flag(&string->obj, STRING_HASHED))
+    {
+        string->hash = hash_string(string->chars, string->length);
+        set_obj_flag(&string->obj, STRING_HASHED);
+    }
+    return string->hash;
+}
+
+static void print_function(ObjFunction *function)
+{
+    if (function->name == NULL)
+    {
+        write_cstring("<script>");
+        return;
+    }
+    write_cstring("<fn ");
+    write_output(function->name->chars, function->name->length);
+    write_char('>');
 }
 
 void print_object(Value value)
@@ -80,7 +259,36 @@ void print_object(Value value)
     switch (OBJ_TYPE(value))
     {
     case OBJ_STRING:
-        printf("%s", AS_CSTRING(value));
+        write_output(AS_CSTRING(value), AS_STRING(value)->length);
+        break;
+    case OBJ_FUNCTION:
+        print_function(AS_FUNCTION(value));
+        break;
+    case OBJ_NATIVE:
+        write_cstring("<native fn>");
+        break;
+    case OBJ_CLOSURE:
+        print_function(AS_CLOSURE(value)->function);
+        break;
+    case OBJ_UPVALUE:
+        // upvalues aren't values user code can get hold of
+        write_cstring("upvalue");
+        break;
+    case OBJ_CLASS:
+        write_output(AS_CLASS(value)->name->chars, AS_CLASS(value)->name->length);
+        break;
+    case OBJ_INSTANCE:
+    {
+        ObjString *name = AS_INSTANCE(value)->klass->name;
+        write_output(name->chars, name->length);
+        write_cstring(" instance");
+        break;
+    }
+    case OBJ_BOUND_METHOD:
+        print_value(AS_BOUND_METHOD(value)->method);
+        break;
+    case OBJ_SHAPE:
+        write_cstring("shape");
         break;
     }
 }
\ No newline at end of file
@@ -2,43 +2,272 @@
 #define clox_object_h
 
 #include "common.h"
+#include "chunk.h"
+#include "table.h"
 #include "value.h"
 
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define OBJ_TYPE(value) (obj_type(AS_OBJ(value)))
 // the reason we don't put the function body directly in the macro is because
 // the value expression is used multiple times, and thus may be evaluated multiple times
 // which would lead to bugs if the expression has side effects
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
+#define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
+#define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
+#define IS_CLOSURE(value) is_obj_type(value, OBJ_CLOSURE)
+#define IS_CLASS(value) is_obj_type(value, OBJ_CLASS)
+#define IS_INSTANCE(value) is_obj_type(value, OBJ_INSTANCE)
+#define IS_BOUND_METHOD(value) is_obj_type(value, OBJ_BOUND_METHOD)
 
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+#define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
 
 typedef enum
 {
     OBJ_STRING,
+    OBJ_FUNCTION,
+    OBJ_NATIVE,
+    OBJ_CLOSURE,
+    OBJ_UPVALUE,
+    OBJ_CLASS,
+    OBJ_INSTANCE,
+    OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
 } ObjType;
 
+// the header of an object is a single word: the next object in vm.objects in the low 48 bits (user space
+// addresses fit in 48 bits on x86-64 and arm64), the type in the 8 bits above that, and 8 bits of flags
+// at the top. Objects are small and many, so the 8 bytes this saves over a type field and a pointer
+// (padded to 16 bytes) are a good part of e.g. a string
 struct Obj
 {
-    ObjType type;
-    struct Obj *next;
+    uint64_t header;
 };
 
+#define OBJ_NEXT_MASK (((uint64_t)1 << 48) - 1)
+#define OBJ_TYPE_SHIFT 48
+#define OBJ_FLAGS_SHIFT 56
+
+// the flags of strings, the other flags are free, e.g. for a garbage collector's mark bits.
+// STRING_INTERNED is set for strings in vm.strings, which are the only string with their chars. All
+// strings are, except for long ones built at runtime (see take_string). STRING_HASHED is set once the
+// hash has been computed: interned strings always have it, the others only once something needed it
+// (see string_hash)
+#define STRING_INTERNED 0x01
+#define STRING_HASHED 0x02
+// OBJ_MARKED is the garbage collector's mark bit. Which of its values means marked flips every collection
+// (see vm.gc_black), so the marks of the last one never have to be cleared
+#define OBJ_MARKED 0x80
+
+static inline ObjType obj_type(Obj *object)
+{
+    return (ObjType)((object->header >> OBJ_TYPE_SHIFT) & 0xff);
+}
+
+static inline Obj *obj_next(Obj *object)
+{
+    return (Obj *)(uintptr_t)(object->header & OBJ_NEXT_MASK);
+}
+
+static inline void set_obj_next(Obj *object, Obj *next)
+{
+    object->header = (object->header & ~OBJ_NEXT_MASK) | (uint64_t)(uintptr_t)next;
+}
+
+static inline bool obj_flag(Obj *object, int flag)
+{
+    return (object->header >> OBJ_FLAGS_SHIFT) & flag;
+}
+
+static inline void set_obj_flag(Obj *object, int flag)
+{
+    object->header |= (uint64_t)flag << OBJ_FLAGS_SHIFT;
+}
+
+static inline void clear_obj_flag(Obj *object, int flag)
+{
+    object->header &= ~((uint64_t)flag << OBJ_FLAGS_SHIFT);
+}
+
 struct ObjString
 {
     Obj obj;
-    int length;
     char *chars;
+    int length;
     uint32_t hash;
 };
 
+// Shape (a.k.a. hidden class) describes the layout of an instance's fields: field i of an instance is
+// stored in slot i of its fields array. Instances that got the same fields in the same order share a
+// shape, so the index of a field can be cached per shape. Shapes are immutable, adding a field moves the
+// instance to a child shape, found through transitions. Every class has its own root shape, so the
+// shape of an instance also tells its class
+typedef struct Shape
+{
+    Obj obj;
+    struct Shape *parent;
+    // field_names[i] is the name of field i. The last one is the field this shape adds to its parent
+    ObjString **field_names;
+    int field_count;
+    // transitions maps the name of a field to the child shape that adds it
+    Table transitions;
+} Shape;
+
+// PropertyCacheEntry remembers where a property access found the field for instances of shape.
+// transition is the shape the instance ends up with, it's only different from shape when setting a
+// field adds it
+typedef struct
+{
+    Shape *shape;
+    Shape *transition;
+    int index;
+} PropertyCacheEntry;
+
+// a site that sees more shapes than this is megamorphic: the shapes beyond these are looked up every time
+#define PROPERTY_CACHE_WAYS 4
+
+// PropertyCache is the inline cache of a get or set property instruction. Mostly a site only ever sees
+// a single shape (monomorphic), so the first entry is checked first
+typedef struct
+{
+    PropertyCacheEntry entries[PROPERTY_CACHE_WAYS];
+    int count;
+} PropertyCache;
+
+// MethodCacheEntry remembers the method a call site found for key: the receiver's shape for OP_INVOKE,
+// which tells the class and also that the instance has no field shadowing the method, or the
+// superclass for OP_SUPER_INVOKE
+typedef struct
+{
+    void *key;
+    Value method;
+} MethodCacheEntry;
+
+#define METHOD_CACHE_WAYS 4
+
+typedef struct
+{
+    MethodCacheEntry entries[METHOD_CACHE_WAYS];
+    int count;
+} MethodCache;
+
+// JitCode is a function's machine code, see jit.h
+typedef struct JitCode JitCode;
+
+// functions are first class, so they're objects. Each one has its own chunk of bytecode, the top-level
+// script is compiled into an implicit function too
+typedef struct
+{
+    Obj obj;
+    int arity;
+    int upvalue_count;
+    Chunk chunk;
+    // max_stack is the most stack slots a call of the function uses, counting from slot zero. A call
+    // makes sure they're all there before the function starts, so pushing never has to check
+    int max_stack;
+    // the property instructions in chunk refer to their caches by index
+    PropertyCache *caches;
+    int cache_count;
+    // and so do the method calls
+    MethodCache *method_caches;
+    int method_cache_count;
+    // hotness counts calls and loop iterations, the function is compiled to machine code once it's
+    // hot enough. jit is NULL until then, or if it can't be compiled
+    uint32_t hotness;
+    JitCode *jit;
+    // NULL for the top-level script
+    ObjString *name;
+} ObjFunction;
+
+// NativeFn is a function implemented in C, it gets its arguments straight from the VM's stack
+typedef Value (*NativeFn)(int arg_count, Value *args);
+
+typedef struct
+{
+    Obj obj;
+    int arity;
+    NativeFn function;
+} ObjNative;
+
+// ObjUpvalue is a captured variable. While the variable is still on the stack the upvalue is open and
+// location points at its stack slot; once it goes out of scope, it's closed: the value moves into
+// closed, and location points there
+typedef struct ObjUpvalue
+{
+    Obj obj;
+    Value *location;
+    Value closed;
+    // the open upvalues form a list sorted by stack slot, top-most first, so a variable captured by
+    // several closures gets a single upvalue they all share
+    struct ObjUpvalue *next;
+} ObjUpvalue;
+
+// ObjClosure is a function along with the variables it captured. Functions that capture nothing are
+// called as they are, without a closure
+typedef struct
+{
+    Obj obj;
+    ObjFunction *function;
+    ObjUpvalue **upvalues;
+    int upvalue_count;
+} ObjClosure;
+
+typedef struct
+{
+    Obj obj;
+    ObjString *name;
+    Table methods;
+    Shape *root_shape;
+    // field_capacity is the most fields any instance of the class got so far. New instances start out
+    // with room for that many, so they usually never have to grow
+    int field_capacity;
+} ObjClass;
+
+typedef struct
+{
+    Obj obj;
+    ObjClass *klass;
+    Shape *shape;
+    Value *fields;
+    int capacity;
+} ObjInstance;
+
+// ObjBoundMethod is a method along with the instance it was accessed on, e.g. the value of "obj.method"
+typedef struct
+{
+    Obj obj;
+    Value receiver;
+    // a function, or a closure if the method captures anything
+    Value method;
+} ObjBoundMethod;
+
 static inline bool is_obj_type(Value value, ObjType type)
 {
-    return IS_OBJ(value) && (AS_OBJ(value)->type == type);
+    return IS_OBJ(value) && obj_type(AS_OBJ(value)) == type;
 }
 
+ObjFunction *new_function();
+ObjNative *new_native(NativeFn function, int arity);
+ObjClosure *new_closure(ObjFunction *function);
+ObjUpvalue *new_upvalue(Value *slot);
+ObjClass *new_class(ObjString *name);
+ObjInstance *new_instance(ObjClass *klass);
+ObjBoundMethod *new_bound_method(Value receiver, Value method);
+int shape_find_field(Shape *shape, ObjString *name);
+Shape *shape_transition(Shape *shape, ObjString *name);
+void instance_reserve_fields(ObjInstance *instance, int count);
 ObjString *copy_string(const char *chars, int length);
+// strings built at runtime that are longer than INTERN_MAX_LENGTH aren't interned: a long string is
+// rarely built twice, so hashing it and looking it up would mostly be wasted. Shorter ones are, since
+// building the same short string over and over (e.g. in a loop) is common, and interning keeps one copy
+#define INTERN_MAX_LENGTH 256
 ObjString *take_string(char *chars, int length);
+uint32_t string_hash(ObjString *string);
 void print_object(Value value);
 
 #endif
\ No newline at end of file
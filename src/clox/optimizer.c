@@ -0,0 +1,1143 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "optimizer.h"
+
+// each round of optimization can make more possible in the next one, e.g. a folded condition makes a
+// branch unreachable, so the optimizer goes round until nothing changes, or this many times. A round that
+// hoists code hoists it out of one loop, so this is also about how many loops get hoisted out of
+#define ROUNDS_MAX 16
+
+// Instruction is an instruction of the code being optimized. Instructions only move when code is hoisted
+// out of a loop, the ones the optimizer gets rid of are only marked removed, and the code is encoded again
+// at the end
+typedef struct
+{
+    // offset and length of the instruction in the optimizer's copy of the code, where its operands are
+    int offset;
+    int length;
+    // op is the opcode, which changes when the instruction is folded: into OP_CONSTANT (loading constant),
+    // OP_NIL, OP_TRUE or OP_FALSE, or into OP_JUMP for a conditional jump whose condition is known
+    uint8_t op;
+    int constant;
+    int line;
+    // target is the index of the instruction a jump lands on
+    int target;
+    // depth is the number of values on the stack before the instruction, counting from the frame's slot
+    // zero, so that a local's slot is its position on the stack. It's -1 for unreachable instructions
+    int depth;
+    // leader is set for the first instruction of a basic block, i.e. one a jump lands on or follows
+    bool leader;
+    bool removed;
+    // loop is the index of the innermost loop the instruction is in, or -1
+    int loop;
+} Instruction;
+
+// StackValue is what the optimizer knows about a value on the stack, within a basic block, and about the
+// locals a loop doesn't change, all through the loop
+typedef struct
+{
+    // known is set for nil, booleans and numbers whose value is known at compile time
+    bool known;
+    Value value;
+    // number is set for values that are known to be numbers, even if which number isn't known
+    bool number;
+    // producer is the instruction that pushed the value, if that's all it did and nothing else refers to
+    // the value, so that the producer can be removed along with the value's one use. -1 otherwise
+    int producer;
+    // a hoistable value is computed by the instructions from start to end, which do nothing but arithmetic
+    // on numbers that stay the same all through the loop around them (see hoist). start is -1 otherwise
+    int start;
+    int end;
+} StackValue;
+
+// Loop is a loop in the code: the instructions from its header, which its OP_LOOP jumps back to, up to
+// that OP_LOOP, its end
+typedef struct
+{
+    int header;
+    int end;
+    // exit is where control goes when the loop is done, the first instruction after it
+    int exit;
+    // parent is the index of the innermost loop this one is in, or -1
+    int parent;
+    // depth is the stack depth at the header, so the slots below it are the locals declared before the
+    // loop. max_depth is the deepest the stack gets in the loop
+    int depth;
+    int max_depth;
+    // invariant[slot] is set for the locals below depth that nothing in the loop assigns and no closure
+    // captures, so they have the same value all through the loop
+    bool *invariant;
+    // single_entry is set when control only gets into the loop by falling into its header. Then what's
+    // known about the invariant locals there, entry, holds all through the loop
+    bool single_entry;
+    StackValue *entry;
+    // hoistable is set when, on top of that, control only leaves the loop to the instruction right after it
+    // (or by returning), which is where the locals hoisted code pushes can be popped again
+    bool hoistable;
+} Loop;
+
+// Hoist is a run of instructions, from start to end, that loop can compute before it starts
+typedef struct
+{
+    int loop;
+    int start;
+    int end;
+} Hoist;
+
+typedef struct
+{
+    ObjFunction *function;
+    Chunk *chunk;
+    // everything the optimizer allocates, including the code it encodes, comes from the arena the chunk
+    // is growing in
+    Arena *arena;
+    // code is a copy of the chunk's code, where the optimizer can change operands and add the bytes of new
+    // instructions without touching the chunk before it's encoded
+    uint8_t *code;
+    int code_count;
+    int code_capacity;
+    Instruction *instructions;
+    int count;
+    StackValue *stack;
+    int stack_size;
+    Loop *loops;
+    int loop_count;
+    // hoists are the runs of instructions the last propagate found could be hoisted out of their loop
+    Hoist *hoists;
+    int hoist_count;
+    bool changed;
+} Optimizer;
+
+static bool is_jump(uint8_t op)
+{
+    return op >= OP_JUMP && op <= OP_LOOP;
+}
+
+static bool falls_through(uint8_t op)
+{
+    return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+}
+
+static bool is_register_op(uint8_t op)
+{
+    return op >= OP_ADD_LL && op < OP_STORE_LOCAL;
+}
+
+// next_live returns the first instruction from index on that hasn't been removed, which is where control
+// goes to instead of a removed instruction
+static int next_live(Optimizer *optimizer, int index)
+{
+    while (index < optimizer->count && optimizer->instructions[index].removed)
+        index++;
+    return index;
+}
+
+static void remove_instruction(Optimizer *optimizer, int index)
+{
+    optimizer->instructions[index].removed = true;
+    optimizer->changed = true;
+}
+
+static bool decode(Optimizer *optimizer)
+{
+    Chunk *chunk = optimizer->chunk;
+    // index maps the offset of each instruction to the instruction, and is -1 between instructions
+    int *index = ARENA_ALLOCATE(optimizer->arena, int, chunk->count);
+    for (int offset = 0; offset < chunk->count; offset++)
+        index[offset] = -1;
+
+    bool ok = true;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        int length = instruction_length(chunk, offset);
+        if (length == 0 || offset + length > chunk->count)
+        {
+            ok = false;
+            break;
+        }
+        Instruction *instruction = &optimizer->instructions[optimizer->count];
+        instruction->offset = offset;
+        instruction->length = length;
+        instruction->op = chunk->code[offset];
+        instruction->constant = -1;
+        instruction->line = chunk->lines[offset];
+        instruction->target = -1;
+        instruction->removed = false;
+        instruction->loop = -1;
+        index[offset] = optimizer->count++;
+        offset += length;
+    }
+
+    for (int i = 0; ok && i < optimizer->count; i++)
+    {
+        Instruction *instruction = &optimizer->instructions[i];
+        if (!is_jump(instruction->op))
+            continue;
+        uint8_t *code = chunk->code + instruction->offset;
+        int jump = (code[1] << 8) | code[2];
+        int target = instruction->op == OP_LOOP ? instruction->offset + 3 - jump : instruction->offset + 3 + jump;
+        if (target < 0 || target >= chunk->count || index[target] == -1)
+            ok = false;
+        else
+            instruction->target = index[target];
+    }
+
+    return ok;
+}
+
+// visit records the stack depth control reaches instruction index with. Returns false if it was reached
+// with a different depth before, which the compiler never does
+static bool visit(Optimizer *optimizer, int index, int depth, int *worklist, int *worklist_count)
+{
+    Instruction *instruction = &optimizer->instructions[index];
+    if (instruction->depth == -1)
+    {
+        instruction->depth = depth;
+        worklist[(*worklist_count)++] = index;
+        return true;
+    }
+    return instruction->depth == depth;
+}
+
+// analyze_flow follows the control flow from the function's entry to work out the stack depth before each
+// instruction, and where the basic blocks start. Instructions it doesn't reach are removed. It returns
+// false if the code doesn't make sense to it, in which case the function isn't optimized
+static bool analyze_flow(Optimizer *optimizer)
+{
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        optimizer->instructions[i].depth = -1;
+        optimizer->instructions[i].leader = false;
+    }
+
+    // each instruction goes onto the worklist at most once
+    int *worklist = ARENA_ALLOCATE(optimizer->arena, int, optimizer->count);
+    int worklist_count = 0;
+    int first = next_live(optimizer, 0);
+    // slot zero and the parameters are on the stack when the function starts
+    int max_depth = optimizer->function->arity + 1;
+    bool ok = first < optimizer->count && visit(optimizer, first, max_depth, worklist, &worklist_count);
+    if (ok)
+        optimizer->instructions[first].leader = true;
+
+    while (ok && worklist_count > 0)
+    {
+        int index = worklist[--worklist_count];
+        Instruction *instruction = &optimizer->instructions[index];
+        uint8_t *operands = optimizer->code + instruction->offset + 1;
+        int depth = instruction->depth + stack_effect(instruction->op, operands);
+        if (depth < 0)
+        {
+            ok = false;
+            break;
+        }
+        if (depth > max_depth)
+            max_depth = depth;
+
+        int next = next_live(optimizer, index + 1);
+        if (is_jump(instruction->op))
+        {
+            int target = next_live(optimizer, instruction->target);
+            ok = target < optimizer->count && visit(optimizer, target, depth, worklist, &worklist_count);
+            if (ok)
+                optimizer->instructions[target].leader = true;
+            if (next < optimizer->count)
+                optimizer->instructions[next].leader = true;
+        }
+        if (ok && falls_through(instruction->op))
+            ok = next < optimizer->count && visit(optimizer, next, depth, worklist, &worklist_count);
+    }
+    if (!ok)
+        return false;
+
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        if (!optimizer->instructions[i].removed && optimizer->instructions[i].depth == -1)
+            remove_instruction(optimizer, i);
+    }
+
+    if (max_depth + 1 > optimizer->stack_size)
+    {
+        optimizer->stack =
+            ARENA_GROW_ARRAY(optimizer->arena, StackValue, optimizer->stack, optimizer->stack_size, max_depth + 1);
+        optimizer->stack_size = max_depth + 1;
+    }
+    return true;
+}
+
+static bool in_loop(Loop *loop, int index)
+{
+    return index >= loop->header && index <= loop->end;
+}
+
+// assigned_slot returns the local instruction assigns, or -1
+static int assigned_slot(Optimizer *optimizer, Instruction *instruction)
+{
+    uint8_t *operands = optimizer->code + instruction->offset + 1;
+    if (instruction->op == OP_SET_LOCAL || instruction->op == OP_STORE_LOCAL)
+        return operands[0];
+    if (is_register_op(instruction->op) && (instruction->op - OP_ADD_LL) % 4 >= 2)
+        return operands[0];
+    return -1;
+}
+
+// compare_loops orders loops by where they start, and the outer one of two that start at the same place
+// first
+static int compare_loops(const void *a, const void *b)
+{
+    const Loop *x = a;
+    const Loop *y = b;
+    if (x->header != y->header)
+        return x->header - y->header;
+    return y->end - x->end;
+}
+
+// find_loops finds the loops in the code, from their OP_LOOPs, how they nest, and which of their locals
+// stay the same
+static void find_loops(Optimizer *optimizer)
+{
+    // a local a closure captures can change whenever the closure runs, so it's never invariant
+    bool *captured = ARENA_ALLOCATE(optimizer->arena, bool, optimizer->stack_size);
+    memset(captured, 0, optimizer->stack_size * sizeof(bool));
+    int loop_capacity = 0;
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        Instruction *instruction = &optimizer->instructions[i];
+        instruction->loop = -1;
+        if (instruction->removed)
+            continue;
+        if (instruction->op == OP_LOOP)
+            loop_capacity++;
+        if (instruction->op == OP_CLOSURE)
+        {
+            uint8_t *operands = optimizer->code + instruction->offset + 1;
+            for (int byte = 1; byte < instruction->length - 1; byte += 2)
+            {
+                if (operands[byte])
+                    captured[operands[byte + 1]] = true;
+            }
+        }
+    }
+
+    optimizer->loops = ARENA_ALLOCATE(optimizer->arena, Loop, loop_capacity);
+    optimizer->loop_count = 0;
+    optimizer->hoists = ARENA_ALLOCATE(optimizer->arena, Hoist, optimizer->count);
+    optimizer->hoist_count = 0;
+    for (int end = 0; end < optimizer->count; end++)
+    {
+        if (optimizer->instructions[end].removed || optimizer->instructions[end].op != OP_LOOP)
+            continue;
+        Loop *loop = &optimizer->loops[optimizer->loop_count++];
+        loop->header = next_live(optimizer, optimizer->instructions[end].target);
+        loop->end = end;
+        loop->exit = next_live(optimizer, end + 1);
+        loop->parent = -1;
+        loop->depth = optimizer->instructions[loop->header].depth;
+        loop->max_depth = loop->depth;
+        loop->invariant = ARENA_ALLOCATE(optimizer->arena, bool, loop->depth);
+        for (int slot = 0; slot < loop->depth; slot++)
+            loop->invariant[slot] = !captured[slot];
+        loop->entry = ARENA_ALLOCATE(optimizer->arena, StackValue, loop->depth);
+        // the code before the header has to fall into it, unless the function starts with the loop
+        int before = loop->header - 1;
+        while (before >= 0 && optimizer->instructions[before].removed)
+            before--;
+        loop->single_entry = before < 0 || falls_through(optimizer->instructions[before].op);
+        loop->hoistable = loop->exit < optimizer->count;
+    }
+    if (optimizer->loop_count == 0)
+        return;
+
+    // the compiler's loops nest, so going through them outer one first, the innermost loop around an
+    // instruction is the last one that has it
+    qsort(optimizer->loops, optimizer->loop_count, sizeof(Loop), compare_loops);
+    int *around = ARENA_ALLOCATE(optimizer->arena, int, optimizer->loop_count);
+    int around_count = 0;
+    for (int l = 0; l < optimizer->loop_count; l++)
+    {
+        Loop *loop = &optimizer->loops[l];
+        while (around_count > 0 && optimizer->loops[around[around_count - 1]].end < loop->header)
+            around_count--;
+        if (around_count > 0)
+        {
+            // loops that overlap without one being in the other aren't something the optimizer follows
+            if (optimizer->loops[around[around_count - 1]].end < loop->end)
+            {
+                optimizer->loop_count = 0;
+                for (int i = 0; i < optimizer->count; i++)
+                    optimizer->instructions[i].loop = -1;
+                return;
+            }
+            loop->parent = around[around_count - 1];
+        }
+        around[around_count++] = l;
+
+        for (int i = loop->header; i <= loop->end; i++)
+        {
+            Instruction *instruction = &optimizer->instructions[i];
+            instruction->loop = l;
+            if (instruction->removed)
+                continue;
+            int slot = assigned_slot(optimizer, instruction);
+            if (slot >= 0 && slot < loop->depth)
+                loop->invariant[slot] = false;
+            if (instruction->depth > loop->max_depth)
+                loop->max_depth = instruction->depth;
+        }
+    }
+
+    // a jump into a loop is another way into it, and a jump out of it has to go where the loop ends
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        Instruction *instruction = &optimizer->instructions[i];
+        if (instruction->removed || !is_jump(instruction->op))
+            continue;
+        int target = next_live(optimizer, instruction->target);
+        for (int l = optimizer->instructions[target].loop; l >= 0 && !in_loop(&optimizer->loops[l], i);
+             l = optimizer->loops[l].parent)
+            optimizer->loops[l].single_entry = false;
+        for (int l = instruction->loop; l >= 0 && !in_loop(&optimizer->loops[l], target); l = optimizer->loops[l].parent)
+        {
+            if (target != optimizer->loops[l].exit)
+                optimizer->loops[l].hoistable = false;
+        }
+    }
+    for (int l = 0; l < optimizer->loop_count; l++)
+        optimizer->loops[l].hoistable = optimizer->loops[l].hoistable && optimizer->loops[l].single_entry;
+}
+
+// forget_stack forgets everything about the stack, at the start of a basic block, or after an instruction
+// the optimizer doesn't follow, e.g. a call, which could change any local through an upvalue
+static void forget_stack(Optimizer *optimizer)
+{
+    for (int i = 0; i < optimizer->stack_size; i++)
+    {
+        optimizer->stack[i].known = false;
+        optimizer->stack[i].number = false;
+        optimizer->stack[i].producer = -1;
+        optimizer->stack[i].start = -1;
+    }
+}
+
+// remember_loops brings back, after forget_stack, what was known when they started about the locals of the
+// loops around instruction index that stay the same all through them
+static void remember_loops(Optimizer *optimizer, int index)
+{
+    for (int l = optimizer->instructions[index].loop; l >= 0; l = optimizer->loops[l].parent)
+    {
+        Loop *loop = &optimizer->loops[l];
+        if (!loop->single_entry)
+            continue;
+        for (int slot = 0; slot < loop->depth; slot++)
+        {
+            // an inner loop may know more about a local than the one around it, and never less
+            StackValue *local = &optimizer->stack[slot];
+            StackValue entry = loop->entry[slot];
+            if (loop->invariant[slot] && (entry.known || (entry.number && !local->known)))
+                *local = entry;
+        }
+    }
+}
+
+// enter_block is where propagate gets to the start of basic block index. At the header of a loop, what's
+// known about the loop's locals is saved for the rest of the loop, before it's forgotten like at the start
+// of any block
+static void enter_block(Optimizer *optimizer, int index)
+{
+    for (int l = optimizer->instructions[index].loop; l >= 0; l = optimizer->loops[l].parent)
+    {
+        Loop *loop = &optimizer->loops[l];
+        if (loop->header != index || !loop->single_entry)
+            continue;
+        for (int slot = 0; slot < loop->depth; slot++)
+        {
+            loop->entry[slot] = optimizer->stack[slot];
+            loop->entry[slot].producer = -1;
+            loop->entry[slot].start = -1;
+        }
+    }
+    forget_stack(optimizer);
+    remember_loops(optimizer, index);
+}
+
+// pin keeps the values up to slot where they are, for an instruction that refers to slot by its position
+static void pin(Optimizer *optimizer, int slot)
+{
+    for (int i = 0; i <= slot; i++)
+        optimizer->stack[i].producer = -1;
+}
+
+static StackValue stack_value(bool known, Value value, int producer)
+{
+    StackValue stack_value = {known, value, known && IS_NUMBER(value), producer, -1, -1};
+    return stack_value;
+}
+
+// unknown_value is a value nothing is known about, other than whether it's a number
+static StackValue unknown_value(bool number)
+{
+    StackValue unknown_value = {false, NIL_VAL, number, -1, -1, -1};
+    return unknown_value;
+}
+
+// stored_value is what's known about a local value is stored into: everything but where it came from
+static StackValue stored_value(StackValue value)
+{
+    value.producer = -1;
+    value.start = -1;
+    return value;
+}
+
+static StackValue constant_value(Value value, int producer)
+{
+    // strings are values too, but nothing they take part in is folded
+    return stack_value(!IS_OBJ(value), value, producer);
+}
+
+static bool is_falsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool are_numbers(StackValue a, StackValue b)
+{
+    return a.known && b.known && IS_NUMBER(a.value) && IS_NUMBER(b.value);
+}
+
+// arithmetic applies an arithmetic operator to known numbers. operator counts from OP_ADD, in the order of
+// the register forms: add, subtract, multiply, divide
+static Value arithmetic(int operator, StackValue a, StackValue b)
+{
+    double x = AS_NUMBER(a.value);
+    double y = AS_NUMBER(b.value);
+    switch (operator)
+    {
+    case 0:
+        return NUMBER_VAL(x + y);
+    case 1:
+        return NUMBER_VAL(x - y);
+    case 2:
+        return NUMBER_VAL(x * y);
+    default:
+        return NUMBER_VAL(x / y);
+    }
+}
+
+// makes_number tells whether arithmetic makes a number, if it doesn't fail. Only an addition can make
+// anything else, when it joins two strings
+static bool makes_number(int operator, StackValue a, StackValue b)
+{
+    return operator != 0 || a.number || b.number;
+}
+
+static Value read_constant(Optimizer *optimizer, Instruction *instruction)
+{
+    uint8_t *operands = optimizer->code + instruction->offset + 1;
+    if (instruction->constant >= 0)
+        return optimizer->chunk->constants.values[instruction->constant];
+    if (instruction->op == OP_CONSTANT)
+        return optimizer->chunk->constants.values[operands[0]];
+    return optimizer->chunk->constants.values[operands[0] | (operands[1] << 8) | (operands[2] << 16)];
+}
+
+// fold turns instruction index, whose operands are the top operand_count values on the stack, into a load
+// of its result, and removes the instructions that pushed the operands. It returns false if they can't be
+// removed
+static bool fold(Optimizer *optimizer, int index, int operand_count, Value result)
+{
+    Instruction *instruction = &optimizer->instructions[index];
+    StackValue *operands = &optimizer->stack[instruction->depth - operand_count];
+    for (int i = 0; i < operand_count; i++)
+    {
+        if (operands[i].producer < 0)
+            return false;
+    }
+
+    if (IS_NUMBER(result))
+    {
+        if (optimizer->chunk->constants.count >= (1 << 24))
+            return false;
+        instruction->op = OP_CONSTANT;
+        instruction->constant = add_constant_to_chunk(optimizer->chunk, result);
+    }
+    else
+    {
+        instruction->op = IS_NIL(result) ? OP_NIL : AS_BOOL(result) ? OP_TRUE : OP_FALSE;
+    }
+
+    for (int i = 0; i < operand_count; i++)
+        remove_instruction(optimizer, operands[i].producer);
+    operands[0] = stack_value(true, result, index);
+    optimizer->changed = true;
+    return true;
+}
+
+// decide_jump settles a conditional jump whose condition is known: it becomes a plain jump if it's taken,
+// and goes away otherwise. Either way, the instructions that pushed its operands go away with it
+static void decide_jump(Optimizer *optimizer, int index, int operand_count, bool taken)
+{
+    Instruction *instruction = &optimizer->instructions[index];
+    for (int i = 0; i < operand_count; i++)
+        remove_instruction(optimizer, optimizer->stack[instruction->depth - 1 - i].producer);
+    if (taken)
+        instruction->op = OP_JUMP;
+    else
+        remove_instruction(optimizer, index);
+    optimizer->changed = true;
+}
+
+// fused_jump_taken tells whether the fused compare-and-branch instruction op jumps for operands a and b
+static bool fused_jump_taken(uint8_t op, StackValue a, StackValue b)
+{
+    switch (op)
+    {
+    case OP_JUMP_IF_NOT_LESS:
+        return !(AS_NUMBER(a.value) < AS_NUMBER(b.value));
+    case OP_JUMP_IF_NOT_GREATER:
+        return !(AS_NUMBER(a.value) > AS_NUMBER(b.value));
+    case OP_JUMP_IF_GREATER:
+        return AS_NUMBER(a.value) > AS_NUMBER(b.value);
+    case OP_JUMP_IF_LESS:
+        return AS_NUMBER(a.value) < AS_NUMBER(b.value);
+    case OP_JUMP_IF_NOT_EQUAL:
+        return !value_equals(a.value, b.value);
+    default:
+        return value_equals(a.value, b.value);
+    }
+}
+
+// hoisting_loop returns the loop instruction index is in if code can be hoisted out of it, or NULL
+static Loop *hoisting_loop(Optimizer *optimizer, int index)
+{
+    int loop = optimizer->instructions[index].loop;
+    return loop >= 0 && optimizer->loops[loop].hoistable ? &optimizer->loops[loop] : NULL;
+}
+
+// is_invariant_number tells whether local slot is a number that stays the same all through loop
+static bool is_invariant_number(Optimizer *optimizer, Loop *loop, int slot)
+{
+    return slot < loop->depth && loop->invariant[slot] && optimizer->stack[slot].number;
+}
+
+// follows tells whether instruction index comes right after the instructions that computed hoistable value
+static bool follows(Optimizer *optimizer, StackValue value, int index)
+{
+    return value.start >= 0 && next_live(optimizer, value.end + 1) == index;
+}
+
+// mark_hoistable marks value, pushed by instruction index, as computed by the instructions from start to
+// index. A run of more than one instruction is worth hoisting, and takes the place of the runs in it
+static void mark_hoistable(Optimizer *optimizer, StackValue *value, int start, int index)
+{
+    value->start = start;
+    value->end = index;
+    if (start == index)
+        return;
+    while (optimizer->hoist_count > 0 && optimizer->hoists[optimizer->hoist_count - 1].start >= start)
+        optimizer->hoist_count--;
+    Hoist *hoist = &optimizer->hoists[optimizer->hoist_count++];
+    hoist->loop = optimizer->instructions[index].loop;
+    hoist->start = start;
+    hoist->end = index;
+}
+
+static void propagate_register_op(Optimizer *optimizer, int index)
+{
+    Instruction *instruction = &optimizer->instructions[index];
+    uint8_t *operands = optimizer->code + instruction->offset + 1;
+    int form = (instruction->op - OP_ADD_LL) % 4;
+    bool stores = form >= 2;
+    bool constant_right = form % 2 == 1;
+    uint8_t *sources = stores ? operands + 1 : operands;
+
+    StackValue left = optimizer->stack[sources[0]];
+    StackValue right = constant_right ? constant_value(optimizer->chunk->constants.values[sources[1]], -1)
+                                      : optimizer->stack[sources[1]];
+    bool known = are_numbers(left, right);
+    int operator = (instruction->op - OP_ADD_LL) / 4;
+    Value result = known ? arithmetic(operator, left, right) : NIL_VAL;
+
+    if (!stores && known && fold(optimizer, index, 0, result))
+        return;
+
+    int slot = sources[0];
+    if (!constant_right && sources[1] > slot)
+        slot = sources[1];
+    if (stores && operands[0] > slot)
+        slot = operands[0];
+    pin(optimizer, slot);
+    StackValue value = known ? stack_value(true, result, -1) : unknown_value(makes_number(operator, left, right));
+    if (stores)
+    {
+        optimizer->stack[operands[0]] = value;
+        return;
+    }
+    optimizer->stack[instruction->depth] = value;
+    Loop *loop = hoisting_loop(optimizer, index);
+    if (loop != NULL && is_invariant_number(optimizer, loop, sources[0]) &&
+        (constant_right ? right.number : is_invariant_number(optimizer, loop, sources[1])))
+        mark_hoistable(optimizer, &optimizer->stack[instruction->depth], index, index);
+}
+
+// propagate follows the values on the stack through each basic block, and the locals that stay the same
+// through each loop, folding whatever it can and finding arithmetic to hoist out of loops
+static void propagate(Optimizer *optimizer)
+{
+    forget_stack(optimizer);
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        Instruction *instruction = &optimizer->instructions[i];
+        if (instruction->removed)
+            continue;
+        if (instruction->leader)
+            enter_block(optimizer, i);
+
+        uint8_t *operands = optimizer->code + instruction->offset + 1;
+        StackValue *stack = optimizer->stack + instruction->depth;
+        switch (instruction->op)
+        {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            stack[0] = constant_value(read_constant(optimizer, instruction), i);
+            if (stack[0].number && hoisting_loop(optimizer, i) != NULL)
+                mark_hoistable(optimizer, &stack[0], i, i);
+            break;
+        case OP_NIL:
+            stack[0] = stack_value(true, NIL_VAL, i);
+            break;
+        case OP_TRUE:
+            stack[0] = stack_value(true, BOOL_VAL(true), i);
+            break;
+        case OP_FALSE:
+            stack[0] = stack_value(true, BOOL_VAL(false), i);
+            break;
+        case OP_GET_LOCAL:
+        {
+            StackValue local = optimizer->stack[operands[0]];
+            pin(optimizer, operands[0]);
+            stack[0] = stored_value(local);
+            stack[0].producer = i;
+            Loop *loop = hoisting_loop(optimizer, i);
+            if (loop != NULL && is_invariant_number(optimizer, loop, operands[0]))
+                mark_hoistable(optimizer, &stack[0], i, i);
+            break;
+        }
+        case OP_GET_UPVALUE:
+            stack[0] = stack_value(false, NIL_VAL, i);
+            break;
+        case OP_GET_GLOBAL:
+            // not a producer that can go away: it fails if the global isn't defined
+            stack[0] = stack_value(false, NIL_VAL, -1);
+            break;
+        case OP_SET_LOCAL:
+            // the value stays on the stack as the value of the assignment
+            pin(optimizer, instruction->depth - 1);
+            optimizer->stack[operands[0]] = stored_value(stack[-1]);
+            break;
+        case OP_STORE_LOCAL:
+            pin(optimizer, operands[0]);
+            optimizer->stack[operands[0]] = stored_value(stack[-1]);
+            break;
+        case OP_SET_GLOBAL:
+            stack[-1].producer = -1;
+            break;
+        case OP_POP:
+            if (stack[-1].producer >= 0)
+            {
+                remove_instruction(optimizer, stack[-1].producer);
+                remove_instruction(optimizer, i);
+            }
+            break;
+        case OP_NEGATE:
+        {
+            if (stack[-1].known && IS_NUMBER(stack[-1].value) &&
+                fold(optimizer, i, 1, NUMBER_VAL(-AS_NUMBER(stack[-1].value))))
+                break;
+            StackValue operand = stack[-1];
+            stack[-1] = unknown_value(true);
+            if (follows(optimizer, operand, i))
+                mark_hoistable(optimizer, &stack[-1], operand.start, i);
+            break;
+        }
+        case OP_NOT:
+            if (stack[-1].known && fold(optimizer, i, 1, BOOL_VAL(is_falsey(stack[-1].value))))
+                break;
+            stack[-1] = stack_value(false, NIL_VAL, -1);
+            break;
+        case OP_EQUAL:
+            if (stack[-2].known && stack[-1].known &&
+                fold(optimizer, i, 2, BOOL_VAL(value_equals(stack[-2].value, stack[-1].value))))
+                break;
+            stack[-2] = stack_value(false, NIL_VAL, -1);
+            break;
+        case OP_GREATER:
+        case OP_LESS:
+            if (are_numbers(stack[-2], stack[-1]) &&
+                fold(optimizer, i, 2,
+                     BOOL_VAL(instruction->op == OP_GREATER ? AS_NUMBER(stack[-2].value) > AS_NUMBER(stack[-1].value)
+                                                            : AS_NUMBER(stack[-2].value) < AS_NUMBER(stack[-1].value))))
+                break;
+            stack[-2] = stack_value(false, NIL_VAL, -1);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_ADD_GENERIC:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        {
+            int operator = instruction->op == OP_SUBTRACT ? 1 : instruction->op == OP_MULTIPLY ? 2
+                                                            : instruction->op == OP_DIVIDE     ? 3
+                                                                                               : 0;
+            if (are_numbers(stack[-2], stack[-1]) &&
+                fold(optimizer, i, 2, arithmetic(operator, stack[-2], stack[-1])))
+                break;
+            StackValue left = stack[-2];
+            StackValue right = stack[-1];
+            stack[-2] = unknown_value(makes_number(operator, left, right));
+            if (follows(optimizer, left, right.start) && follows(optimizer, right, i))
+                mark_hoistable(optimizer, &stack[-2], left.start, i);
+            break;
+        }
+        case OP_GET_PROPERTY:
+            stack[-1] = stack_value(false, NIL_VAL, -1);
+            break;
+        case OP_SET_PROPERTY:
+            stack[-2] = stack_value(false, NIL_VAL, -1);
+            break;
+        case OP_PRINT:
+        case OP_DEFINE_GLOBAL:
+        case OP_JUMP:
+        case OP_LOOP:
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            if (stack[-1].known && stack[-1].producer >= 0)
+                decide_jump(optimizer, i, 1, is_falsey(stack[-1].value));
+            break;
+        case OP_JUMP_IF_FALSE:
+            // the condition stays on the stack either way
+            if (stack[-1].known)
+                decide_jump(optimizer, i, 0, is_falsey(stack[-1].value));
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+        {
+            bool equality = instruction->op == OP_JUMP_IF_NOT_EQUAL || instruction->op == OP_JUMP_IF_EQUAL;
+            bool known = equality ? stack[-2].known && stack[-1].known : are_numbers(stack[-2], stack[-1]);
+            if (known && stack[-2].producer >= 0 && stack[-1].producer >= 0)
+                decide_jump(optimizer, i, 2, fused_jump_taken(instruction->op, stack[-2], stack[-1]));
+            break;
+        }
+        default:
+            if (is_register_op(instruction->op))
+            {
+                propagate_register_op(optimizer, i);
+            }
+            else
+            {
+                // the locals a loop keeps the same can't change here either, as no closure captures them
+                forget_stack(optimizer);
+                remember_loops(optimizer, i);
+            }
+            break;
+        }
+    }
+}
+
+// thread_jumps makes forward jumps that land on an unconditional jump go straight to where that one goes,
+// and removes unconditional jumps to the instruction right after them
+static void thread_jumps(Optimizer *optimizer)
+{
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        Instruction *instruction = &optimizer->instructions[i];
+        if (instruction->removed || !is_jump(instruction->op) || instruction->op == OP_LOOP)
+            continue;
+
+        // unconditional jumps only go forward, so this ends
+        int target = next_live(optimizer, instruction->target);
+        while (target < optimizer->count && optimizer->instructions[target].op == OP_JUMP)
+            target = next_live(optimizer, optimizer->instructions[target].target);
+        if (target != next_live(optimizer, instruction->target))
+        {
+            instruction->target = target;
+            optimizer->changed = true;
+        }
+
+        if (instruction->op == OP_JUMP && target == next_live(optimizer, i + 1))
+            remove_instruction(optimizer, i);
+    }
+}
+
+// add_code adds the bytes of a new instruction to the optimizer's copy of the code, and returns their offset
+static int add_code(Optimizer *optimizer, uint8_t op, uint8_t operand)
+{
+    if (optimizer->code_count + 2 > optimizer->code_capacity)
+    {
+        int capacity = optimizer->code_capacity * 2 + 2;
+        optimizer->code = ARENA_GROW_ARRAY(optimizer->arena, uint8_t, optimizer->code, optimizer->code_capacity, capacity);
+        optimizer->code_capacity = capacity;
+    }
+    optimizer->code[optimizer->code_count] = op;
+    optimizer->code[optimizer->code_count + 1] = operand;
+    optimizer->code_count += 2;
+    return optimizer->code_count - 2;
+}
+
+static Instruction new_instruction(Optimizer *optimizer, uint8_t op, uint8_t operand, int length, int line)
+{
+    Instruction instruction;
+    instruction.offset = add_code(optimizer, op, operand);
+    instruction.length = length;
+    instruction.op = op;
+    instruction.constant = -1;
+    instruction.line = line;
+    instruction.target = -1;
+    instruction.depth = -1;
+    instruction.leader = false;
+    instruction.removed = false;
+    instruction.loop = -1;
+    return instruction;
+}
+
+// shift_slots moves the locals from slot on that instruction refers to up by count
+static void shift_slots(Optimizer *optimizer, Instruction *instruction, int slot, int count)
+{
+    uint8_t *operands = optimizer->code + instruction->offset + 1;
+    int first = 0;
+    int last = -1;
+    int step = 1;
+    if (instruction->op == OP_GET_LOCAL || instruction->op == OP_SET_LOCAL || instruction->op == OP_STORE_LOCAL)
+    {
+        last = 0;
+    }
+    else if (instruction->op == OP_CLOSURE)
+    {
+        // the index of each upvalue that captures a local, rather than one of the function's upvalues
+        first = 2;
+        last = instruction->length - 2;
+        step = 2;
+    }
+    else if (is_register_op(instruction->op))
+    {
+        // the constant of a form with one isn't a local
+        int form = (instruction->op - OP_ADD_LL) % 4;
+        last = instruction->length - 2 - form % 2;
+    }
+
+    for (int i = first; i <= last; i += step)
+    {
+        if ((instruction->op != OP_CLOSURE || operands[i - 1]) && operands[i] >= slot)
+            operands[i] += count;
+    }
+}
+
+// hoist moves the arithmetic the last propagate found to hoist out of a loop (the first loop it found any
+// in) to just before the loop, where each result is pushed as a new local, which the loop then reads
+// instead. These locals go on the stack under the ones the loop declares, which move up to make room, and
+// are popped right after the loop. Only arithmetic on numbers is hoisted, which can't fail or do anything
+// else, so it doesn't matter that it now runs once even if the loop never gets to it. Returns false if
+// there was nothing to hoist
+static bool hoist(Optimizer *optimizer)
+{
+    if (optimizer->hoist_count == 0)
+        return false;
+    int l = optimizer->hoists[0].loop;
+    Loop *loop = &optimizer->loops[l];
+    int header = loop->header;
+    int end = loop->end;
+
+    // the hoists for the loop, as many as the loop's locals still fit in a byte with
+    Hoist *hoists = ARENA_ALLOCATE(optimizer->arena, Hoist, optimizer->hoist_count);
+    int hoist_count = 0;
+    int moved = 0;
+    for (int h = 0; h < optimizer->hoist_count && loop->max_depth + hoist_count < UINT8_COUNT; h++)
+    {
+        Hoist hoist = optimizer->hoists[h];
+        if (hoist.loop != l)
+            continue;
+        hoists[hoist_count++] = hoist;
+        for (int i = hoist.start; i <= hoist.end; i++)
+            moved += !optimizer->instructions[i].removed;
+    }
+    if (hoist_count == 0)
+        return false;
+
+    // the instructions before the loop stay where they are, then come the hoisted ones, the loop, the pops
+    // and the rest
+    Instruction *old = optimizer->instructions;
+    int count = optimizer->count + moved + hoist_count;
+    Instruction *instructions = ARENA_ALLOCATE(optimizer->arena, Instruction, count);
+    int n = 0;
+    for (int i = 0; i < header; i++)
+        instructions[n++] = old[i];
+    for (int h = 0; h < hoist_count; h++)
+    {
+        for (int i = hoists[h].start; i <= hoists[h].end; i++)
+        {
+            if (!old[i].removed)
+                instructions[n++] = old[i];
+        }
+    }
+    for (int i = header; i <= end; i++)
+    {
+        instructions[n] = old[i];
+        if (!old[i].removed)
+            shift_slots(optimizer, &instructions[n], loop->depth, hoist_count);
+        n++;
+    }
+    int pops = n;
+    for (int h = 0; h < hoist_count; h++)
+        instructions[n++] = new_instruction(optimizer, OP_POP, 0, 1, old[end].line);
+    for (int i = end + 1; i < optimizer->count; i++)
+        instructions[n++] = old[i];
+
+    // jumps out of the loop now go to the pops, and all of them to wherever what they jumped to went
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        if (old[i].removed || !is_jump(old[i].op))
+            continue;
+        int at = i < header ? i : i <= end ? i + moved : i + moved + hoist_count;
+        int target = next_live(optimizer, old[i].target);
+        if (in_loop(loop, i) && target == loop->exit)
+            instructions[at].target = pops;
+        else
+            instructions[at].target = target < header ? target : target <= end ? target + moved : target + moved + hoist_count;
+    }
+
+    // and in the loop, each hoisted run gives way to reading its local
+    for (int h = 0; h < hoist_count; h++)
+    {
+        Instruction *first = &instructions[hoists[h].start + moved];
+        *first = new_instruction(optimizer, OP_GET_LOCAL, loop->depth + h, 2, first->line);
+        for (int i = hoists[h].start + 1; i <= hoists[h].end; i++)
+            instructions[i + moved].removed = true;
+    }
+
+    optimizer->instructions = instructions;
+    optimizer->count = count;
+    optimizer->changed = true;
+    return true;
+}
+
+static int encoded_length(Instruction *instruction)
+{
+    if (instruction->constant >= 0)
+        return instruction->constant <= UINT8_MAX ? 2 : 4;
+    if (instruction->op == OP_NIL || instruction->op == OP_TRUE || instruction->op == OP_FALSE)
+        return 1;
+    return instruction->length;
+}
+
+// encode writes the instructions that are left back into the chunk. It returns false, leaving the chunk
+// alone, if a jump doesn't fit anymore (a folded constant can take more space than what it replaced)
+static bool encode(Optimizer *optimizer)
+{
+    Chunk *chunk = optimizer->chunk;
+    // a removed instruction takes no space, so it starts where the next live one does, and jumps to it
+    // land there
+    int *offsets = ARENA_ALLOCATE(optimizer->arena, int, optimizer->count + 1);
+    int size = 0;
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        offsets[i] = size;
+        if (!optimizer->instructions[i].removed)
+            size += encoded_length(&optimizer->instructions[i]);
+    }
+    offsets[optimizer->count] = size;
+
+    uint8_t *code = ARENA_ALLOCATE(optimizer->arena, uint8_t, size);
+    int *lines = ARENA_ALLOCATE(optimizer->arena, int, size);
+    bool ok = true;
+    for (int i = 0; ok && i < optimizer->count; i++)
+    {
+        Instruction *instruction = &optimizer->instructions[i];
+        if (instruction->removed)
+            continue;
+
+        uint8_t *at = code + offsets[i];
+        int length = encoded_length(instruction);
+        if (is_jump(instruction->op))
+        {
+            int end = offsets[i] + 3;
+            int jump = instruction->op == OP_LOOP ? end - offsets[instruction->target] : offsets[instruction->target] - end;
+            ok = jump >= 0 && jump <= UINT16_MAX;
+            at[0] = instruction->op;
+            at[1] = (jump >> 8) & 0xff;
+            at[2] = jump & 0xff;
+        }
+        else if (instruction->constant >= 0)
+        {
+            at[0] = length == 2 ? OP_CONSTANT : OP_CONSTANT_LONG;
+            for (int byte = 1; byte < length; byte++)
+                at[byte] = (instruction->constant >> (8 * (byte - 1))) & 0xff;
+        }
+        else if (length == 1)
+        {
+            at[0] = instruction->op;
+        }
+        else
+        {
+            memcpy(at, optimizer->code + instruction->offset, length);
+        }
+        for (int byte = 0; byte < length; byte++)
+            lines[offsets[i] + byte] = instruction->line;
+    }
+
+    // the code that isn't used, old or new, stays in the arena until the compiler is done
+    if (!ok)
+        return false;
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->count = size;
+    chunk->capacity = size;
+    return true;
+}
+
+void optimize_function(ObjFunction *function)
+{
+    Optimizer optimizer;
+    optimizer.function = function;
+    optimizer.chunk = &function->chunk;
+    optimizer.arena = function->chunk.arena;
+    optimizer.count = 0;
+    optimizer.stack = NULL;
+    optimizer.stack_size = 0;
+    optimizer.loop_count = 0;
+    optimizer.hoist_count = 0;
+    if (optimizer.chunk->count == 0 || optimizer.arena == NULL)
+        return;
+    optimizer.code = ARENA_ALLOCATE(optimizer.arena, uint8_t, optimizer.chunk->count);
+    memcpy(optimizer.code, optimizer.chunk->code, optimizer.chunk->count);
+    optimizer.code_count = optimizer.chunk->count;
+    optimizer.code_capacity = optimizer.chunk->count;
+    // an instruction takes at least a byte
+    optimizer.instructions = ARENA_ALLOCATE(optimizer.arena, Instruction, optimizer.chunk->count);
+
+    bool ok = decode(&optimizer);
+    bool optimized = false;
+    for (int round = 0; ok && round < ROUNDS_MAX; round++)
+    {
+        optimizer.changed = false;
+        ok = analyze_flow(&optimizer);
+        if (!ok)
+            break;
+        find_loops(&optimizer);
+        propagate(&optimizer);
+        thread_jumps(&optimizer);
+        // code is only hoisted once everything else has settled, since the rest moves it around
+        if (!optimizer.changed && !hoist(&optimizer))
+            break;
+        optimized = true;
+    }
+    // the last round may have left code unreachable, and the flow has to make sense before it's encoded
+    if (ok && optimized && analyze_flow(&optimizer))
+        encode(&optimizer);
+}
\ No newline at end of file
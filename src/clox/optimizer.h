@@ -0,0 +1,20 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "object.h"
+
+// the optimizer is an optional pass over the bytecode of a function the compiler has just finished. It
+// decodes the code into a list of instructions with their control flow, stack depths and loops, and then:
+// - propagates constants through the stack and through locals, within each basic block and, for the
+//   locals a loop never assigns, from the start of the loop through all of it, and folds arithmetic,
+//   comparisons and conditional jumps on them
+// - removes values that are pushed only to be popped again, and code that can't be reached
+// - threads jumps to jumps, and removes jumps to the next instruction
+// - hoists arithmetic on numbers that stay the same through a loop out of it, into a hidden local the loop
+//   reads instead
+// before encoding the result back into the function's chunk. Nothing it does changes what a program
+// prints or which errors it reports, from which line. It works on chunks that are still growing in the
+// compiler's arena, and leaves functions whose chunk is already on the heap alone
+void optimize_function(ObjFunction *function);
+
+#endif
\ No newline at end of file
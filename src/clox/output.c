@@ -0,0 +1,117 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "number.h"
+#include "output.h"
+
+typedef struct
+{
+    char chars[OUTPUT_BUFFER_SIZE];
+    size_t count;
+    // when stdout is a terminal, someone is watching the output as it's produced, so we hand over
+    // every complete line rather than waiting for the buffer to fill up
+    bool line_buffered;
+} Output;
+
+static Output output;
+
+void init_output()
+{
+    static bool initialized = false;
+    output.count = 0;
+    output.line_buffered = isatty(STDOUT_FILENO);
+    if (!initialized)
+    {
+        // whatever is still buffered must make it out no matter how the process exits
+        atexit(flush_output);
+        initialized = true;
+    }
+}
+
+void flush_output()
+{
+    if (output.count > 0)
+    {
+        fwrite(output.chars, sizeof(char), output.count, stdout);
+        output.count = 0;
+    }
+    fflush(stdout);
+}
+
+void write_output(const char *chars, size_t length)
+{
+    if (output.count + length > OUTPUT_BUFFER_SIZE)
+    {
+        flush_output();
+        if (length > OUTPUT_BUFFER_SIZE)
+        {
+            // too big to ever fit in the buffer, so don't bother copying it
+            fwrite(chars, sizeof(char), length, stdout);
+            return;
+        }
+    }
+    memcpy(output.chars + output.count, chars, length);
+    output.count += length;
+}
+
+void write_char(char c)
+{
+    if (output.count == OUTPUT_BUFFER_SIZE)
+        flush_output();
+    output.chars[output.count++] = c;
+}
+
+void write_cstring(const char *chars)
+{
+    write_output(chars, strlen(chars));
+}
+
+void write_number(double value)
+{
+    if (output.count + NUMBER_BUFFER_SIZE > OUTPUT_BUFFER_SIZE)
+        flush_output();
+    // format straight into the buffer, there's always room for the longest number
+    output.count += format_number(value, output.chars + output.count);
+}
+
+// write_format is for the places where convenience matters more than speed, e.g. the disassembler
+void write_format(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    size_t available = OUTPUT_BUFFER_SIZE - output.count;
+    int length = vsnprintf(output.chars + output.count, available, format, args);
+    va_end(args);
+
+    if (length < 0)
+        return;
+    if ((size_t)length < available)
+    {
+        output.count += length;
+        return;
+    }
+
+    // didn't fit, make room and try again
+    flush_output();
+    va_start(args, format);
+    if ((size_t)length < OUTPUT_BUFFER_SIZE)
+    {
+        output.count = vsnprintf(output.chars, OUTPUT_BUFFER_SIZE, format, args);
+    }
+    else
+    {
+        vfprintf(stdout, format, args);
+    }
+    va_end(args);
+}
+
+// write_line_end ends the current line of output, e.g. after each print statement
+void write_line_end()
+{
+    write_char('\n');
+    if (output.line_buffered)
+        flush_output();
+}
\ No newline at end of file
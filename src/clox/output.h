@@ -0,0 +1,20 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+
+// all of the VM's stdout output goes through a single buffer, which is handed to stdio in large
+// blocks. That way printing a value costs a memcpy into the buffer, instead of a (locking)
+// printf call with its format string parsing per value
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+void init_output();
+void write_output(const char *chars, size_t length);
+void write_char(char c);
+void write_cstring(const char *chars);
+void write_number(double value);
+void write_format(const char *format, ...);
+void write_line_end();
+void flush_output();
+
+#endif
\ No newline at end of file
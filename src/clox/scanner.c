@@ -1,26 +1,35 @@
 #include <string.h>
 #include "scanner.h"
 #include "common.h"
+#include "number.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The scanner works on an explicit [source, source + length) range rather than relying on a NUL
+// terminator, so it can scan a memory-mapped file in place (see load_source in main.c)
 typedef struct
 {
     const char *start;
     const char *current;
+    const char *end;
     int line;
 } Scanner;
 
 Scanner scanner;
 
-void init_scanner(const char *source)
+void init_scanner(const char *source, size_t length)
 {
     scanner.start = source;
     scanner.current = source;
+    scanner.end = source + length;
     scanner.line = 1;
 }
 
 static bool is_at_end()
 {
-    return *scanner.current == '\0';
+    return scanner.current >= scanner.end;
 }
 
 static Token make_token(TokenType type)
@@ -50,50 +59,244 @@ static char advance()
     return *scanner.current++;
 }
 
+// peek and peek_next return '\0' past the end of the source, which no token can contain
 static char peek()
 {
+    if (is_at_end())
+        return '\0';
     return *scanner.current;
 }
 
 static char peek_next()
 {
-    if (is_at_end())
+    if (scanner.current + 1 >= scanner.end)
         return '\0';
     return scanner.current[1];
 }
 
-static void skip_whitespace()
+// char_classes classifies every byte with a single table lookup, instead of a chain of range comparisons
+#define CHAR_DIGIT 0x1
+#define CHAR_ALPHA 0x2
+#define CHAR_BLANK 0x4
+
+static const uint8_t char_classes[256] = {
+    ['0' ... '9'] = CHAR_DIGIT,
+    ['a' ... 'z'] = CHAR_ALPHA,
+    ['A' ... 'Z'] = CHAR_ALPHA,
+    ['_'] = CHAR_ALPHA,
+    [' '] = CHAR_BLANK,
+    ['\t'] = CHAR_BLANK,
+    ['\r'] = CHAR_BLANK,
+    ['\n'] = CHAR_BLANK,
+};
+
+static bool is_digit(char c)
 {
-    for (;;)
+    return char_classes[(uint8_t)c] & CHAR_DIGIT;
+}
+
+static bool is_alpha(char c)
+{
+    return char_classes[(uint8_t)c] & CHAR_ALPHA;
+}
+
+static bool is_alphanumeric(char c)
+{
+    return char_classes[(uint8_t)c] & (CHAR_DIGIT | CHAR_ALPHA);
+}
+
+// The skip_* functions below advance over runs of whitespace, identifier characters, string bodies and
+// comments. With SSE2 (which every x86-64 CPU has) they look at 16 bytes at a time: a few compares
+// produce a bitmask of the bytes that belong to the run, and the run ends at the first zero bit.
+// Near the end of the source, where a 16 byte load would read past it, they finish byte by byte.
+#ifdef __SSE2__
+#define SIMD_BLOCK 16
+#define FULL_BLOCK 0xFFFF
+
+static inline __m128i load_block(const char *chars)
+{
+    return _mm_loadu_si128((const __m128i *)chars);
+}
+
+// byte_mask sets bit i when byte i of the block is c
+static inline unsigned byte_mask(__m128i block, char c)
+{
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// range_mask sets bit i when byte i of the block is in [low, high]. The comparisons are signed, which
+// is fine for ASCII ranges: bytes >= 0x80 are negative and never in range
+static inline __m128i range_mask(__m128i block, char low, char high)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8(low - 1)), _mm_cmplt_epi8(block, _mm_set1_epi8(high + 1)));
+}
+
+// first_n_bits masks the bits of the bytes before the end of the run
+static inline unsigned first_n_bits(int n)
+{
+    return (1u << n) - 1;
+}
+#endif
+
+static bool is_blank(char c)
+{
+    return char_classes[(uint8_t)c] & CHAR_BLANK;
+}
+
+// most runs are short (the single space between two tokens, an identifier like "i"), and a 16 byte
+// block costs more than it saves for those. So every run starts out byte by byte and only switches to
+// 16 byte blocks when it's at least SHORT_RUN bytes long (indentation, long names, strings, comments).
+// The loops work on local copies of the scanner's pointers: since a char can alias anything, the
+// compiler would otherwise have to write scanner.current back to memory on every byte
+#define SHORT_RUN 8
+
+static void skip_blanks()
+{
+    const char *current = scanner.current;
+    const char *end = scanner.end;
+    int line = scanner.line;
+
+    const char *short_run_end = end - current > SHORT_RUN ? current + SHORT_RUN : end;
+    while (current < short_run_end && is_blank(*current))
+    {
+        line += *current == '\n';
+        current++;
+    }
+#ifdef __SSE2__
+    while (end - current >= SIMD_BLOCK && is_blank(*current))
     {
-        char c = peek();
-        switch (c)
+        __m128i block = load_block(current);
+        unsigned newlines = byte_mask(block, '\n');
+        unsigned blanks = newlines | byte_mask(block, ' ') | byte_mask(block, '\t') | byte_mask(block, '\r');
+        if (blanks != FULL_BLOCK)
         {
-        case '\t':
-        case '\r':
-        case ' ':
-            advance();
+            int run = __builtin_ctz(~blanks);
+            line += __builtin_popcount(newlines & first_n_bits(run));
+            current += run;
             break;
-        case '\n':
-            scanner.line++;
-            advance();
-            break;
-        case '/':
-            if (peek_next() == '/')
-            {
-                // we're in a comment; keep consuming and throwing away tokens until newline
-                // because we increment the line counter at end of line
-                while (peek() != '\n' && !is_at_end())
-                    advance();
-            }
-            else
-            {
-                // not whitespace, stop skipping and parse the token
-                return;
-            }
-        default:
+        }
+        line += __builtin_popcount(newlines);
+        current += SIMD_BLOCK;
+    }
+#endif
+    while (current < end && is_blank(*current))
+    {
+        line += *current == '\n';
+        current++;
+    }
+
+    scanner.current = current;
+    scanner.line = line;
+}
+
+// skip_comment advances to the newline that ends the comment, leaving the newline to skip_blanks,
+// which counts lines. Comments tend to be long, so they go straight to 16 byte blocks
+static void skip_comment()
+{
+    const char *current = scanner.current;
+    const char *end = scanner.end;
+#ifdef __SSE2__
+    while (end - current >= SIMD_BLOCK)
+    {
+        unsigned newlines = byte_mask(load_block(current), '\n');
+        if (newlines != 0)
+        {
+            current += __builtin_ctz(newlines);
+            scanner.current = current;
             return;
         }
+        current += SIMD_BLOCK;
+    }
+#endif
+    while (current < end && *current != '\n')
+        current++;
+    scanner.current = current;
+}
+
+static void skip_identifier_chars()
+{
+    const char *current = scanner.current;
+    const char *end = scanner.end;
+
+    const char *short_run_end = end - current > SHORT_RUN ? current + SHORT_RUN : end;
+    while (current < short_run_end && is_alphanumeric(*current))
+        current++;
+#ifdef __SSE2__
+    while (end - current >= SIMD_BLOCK && is_alphanumeric(*current))
+    {
+        __m128i block = load_block(current);
+        // setting bit 5 folds upper case letters into lower case
+        __m128i letters = range_mask(_mm_or_si128(block, _mm_set1_epi8(0x20)), 'a', 'z');
+        __m128i digits = range_mask(block, '0', '9');
+        unsigned chars = (unsigned)_mm_movemask_epi8(_mm_or_si128(letters, digits)) | byte_mask(block, '_');
+        if (chars != FULL_BLOCK)
+        {
+            current += __builtin_ctz(~chars);
+            break;
+        }
+        current += SIMD_BLOCK;
+    }
+#endif
+    while (current < end && is_alphanumeric(*current))
+        current++;
+
+    scanner.current = current;
+}
+
+// skip_string_body advances to the closing quote (or the end of the source), counting the newlines
+// inside the string
+static void skip_string_body()
+{
+    const char *current = scanner.current;
+    const char *end = scanner.end;
+    int line = scanner.line;
+
+    const char *short_run_end = end - current > SHORT_RUN ? current + SHORT_RUN : end;
+    while (current < short_run_end && *current != '"')
+    {
+        line += *current == '\n';
+        current++;
+    }
+#ifdef __SSE2__
+    while (end - current >= SIMD_BLOCK && *current != '"')
+    {
+        __m128i block = load_block(current);
+        unsigned newlines = byte_mask(block, '\n');
+        unsigned quotes = byte_mask(block, '"');
+        if (quotes != 0)
+        {
+            int run = __builtin_ctz(quotes);
+            line += __builtin_popcount(newlines & first_n_bits(run));
+            current += run;
+            break;
+        }
+        line += __builtin_popcount(newlines);
+        current += SIMD_BLOCK;
+    }
+#endif
+    while (current < end && *current != '"')
+    {
+        line += *current == '\n';
+        current++;
+    }
+
+    scanner.current = current;
+    scanner.line = line;
+}
+
+static void skip_whitespace()
+{
+    for (;;)
+    {
+        skip_blanks();
+        if (peek() == '/' && peek_next() == '/')
+        {
+            // we're in a comment; throw it away up to the newline, then keep skipping
+            skip_comment();
+            continue;
+        }
+        // not whitespace, stop skipping and parse the token
+        return;
     }
 }
 
@@ -112,12 +315,7 @@ static char match(char expected)
 
 static Token string()
 {
-    while (peek() != '"' && !is_at_end())
-    {
-        if (peek() == '\n')
-            scanner.line++;
-        advance();
-    }
+    skip_string_body();
 
     if (is_at_end())
     {
@@ -130,26 +328,42 @@ static Token string()
     return make_token(TOKEN_STRING);
 }
 
-static bool is_digit(char c)
-{
-    return c >= '0' && c <= '9';
-}
-
-static bool is_alpha(char c)
+// NumberLiteral accumulates the value of a number literal as significand * 10^exponent while its
+// digits are scanned
+typedef struct
 {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
-}
+    uint64_t significand;
+    int exponent;
+    // truncated is set when there are more significant digits than fit in the significand
+    bool truncated;
+} NumberLiteral;
 
-static bool is_alphanumeric(char c)
+static void add_digit(NumberLiteral *literal, char c, bool fraction)
 {
-    return is_digit(c) || is_alpha(c);
+    // 19 digits always fit into 64 bits
+    if (literal->significand < 1000000000000000000ULL)
+    {
+        literal->significand = literal->significand * 10 + (c - '0');
+        if (fraction)
+            literal->exponent--;
+    }
+    else
+    {
+        if (!fraction)
+            literal->exponent++;
+        if (c != '0')
+            literal->truncated = true;
+    }
 }
 
 static Token number()
 {
+    // the first digit has already been consumed by scan_token
+    NumberLiteral literal = {(uint64_t)(scanner.start[0] - '0'), 0, false};
+
     while (is_digit(peek()))
     {
-        advance();
+        add_digit(&literal, advance(), false);
     }
 
     // look for fractional part
@@ -158,83 +372,67 @@ static Token number()
         advance();
         // consume fractional part
         while (is_digit(peek()))
-            advance();
+            add_digit(&literal, advance(), true);
     }
 
-    return make_token(TOKEN_NUMBER);
-}
-
-static TokenType check_keyword(int start, int length, const char *rest, TokenType type)
-{
-    if ((scanner.current - scanner.start == start + length) && memcmp(scanner.start + start, rest, length) == 0)
+    Token token = make_token(TOKEN_NUMBER);
+    if (literal.truncated || !decimal_to_double(literal.significand, literal.exponent, &token.number))
     {
-        return type;
+        token.number = parse_number(token.start, token.length);
     }
-
-    return TOKEN_IDENTIFIER;
+    return token;
 }
 
+// Keywords are recognized with a perfect hash: for Lox's keywords, the first char, the last char and
+// the length are enough to tell them apart, and KEYWORD_HASH maps each of them to its own slot.
+// So an identifier costs one table lookup and at most one memcmp, instead of walking a trie
+#define KEYWORD_HASH(first, last, length) (((first) + 5 * (last) + (length)) & 31)
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 6
+
+typedef struct
+{
+    const char *chars;
+    int length;
+    TokenType type;
+} Keyword;
+
+// the indices are the KEYWORD_HASH values of the keywords; the empty slots have length 0
+static const Keyword keywords[32] = {
+    [2] = {"else", 4, TOKEN_ELSE},
+    [3] = {"for", 3, TOKEN_FOR},
+    [4] = {"false", 5, TOKEN_FALSE},
+    [7] = {"class", 5, TOKEN_CLASS},
+    [9] = {"if", 2, TOKEN_IF},
+    [11] = {"or", 2, TOKEN_OR},
+    [13] = {"nil", 3, TOKEN_NIL},
+    [15] = {"fun", 3, TOKEN_FUN},
+    [17] = {"true", 4, TOKEN_TRUE},
+    [18] = {"super", 5, TOKEN_SUPER},
+    [19] = {"var", 3, TOKEN_VAR},
+    [21] = {"while", 5, TOKEN_WHILE},
+    [23] = {"this", 4, TOKEN_THIS},
+    [24] = {"and", 3, TOKEN_AND},
+    [25] = {"print", 5, TOKEN_PRINT},
+    [30] = {"return", 6, TOKEN_RETURN},
+};
+
 static TokenType identifer_type()
 {
-    switch (scanner.start[0])
-    {
-    case 'a':
-        return check_keyword(1, 2, "nd", TOKEN_AND);
-    case 'c':
-        return check_keyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e':
-        return check_keyword(1, 3, "lse", TOKEN_ELSE);
-    case 'f':
-        if (scanner.current - scanner.start > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'a':
-                return check_keyword(2, 3, "lse", TOKEN_FALSE);
-            case 'o':
-                return check_keyword(2, 1, "r", TOKEN_FOR);
-            case 'u':
-                return check_keyword(2, 1, "n", TOKEN_FUN);
-            }
-        }
-    case 'i':
-        return check_keyword(1, 1, "f", TOKEN_IF);
-    case 'n':
-        return check_keyword(1, 2, "il", TOKEN_NIL);
-    case 'o':
-        return check_keyword(1, 1, "r", TOKEN_OR);
-    case 'p':
-        return check_keyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r':
-        return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's':
-        return check_keyword(1, 4, "uper", TOKEN_SUPER);
-    case 't':
-        if (scanner.current - scanner.start > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'h':
-                return check_keyword(2, 2, "is", TOKEN_THIS);
-            case 'r':
-                return check_keyword(2, 2, "ue", TOKEN_TRUE);
-            }
-        }
-    case 'v':
-        return check_keyword(1, 2, "ar", TOKEN_VAR);
-    case 'w':
-        return check_keyword(1, 4, "hile", TOKEN_WHILE);
-    default:
+    int length = (int)(scanner.current - scanner.start);
+    if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH)
         return TOKEN_IDENTIFIER;
-    }
+
+    const Keyword *keyword = &keywords[KEYWORD_HASH((uint8_t)scanner.start[0], (uint8_t)scanner.start[length - 1], length)];
+    if (keyword->length == length && memcmp(scanner.start, keyword->chars, length) == 0)
+        return keyword->type;
+
+    return TOKEN_IDENTIFIER;
 }
 
 Token identifier()
 {
-    while (is_alphanumeric(peek()))
-    {
-        advance();
-    }
+    skip_identifier_chars();
 
     return make_token(identifer_type());
 }
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 typedef enum
 {
     // Single-character tokens.
@@ -58,15 +60,18 @@ typedef enum
 // we don't need to dynamically manage the memory, and just ensure that the original
 // source data structure outlives all the lexemes, i.e., isn't freed until they're all
 // interpreted by the VM.
+// Number literals are converted to their value while they're scanned, since the scanner walks
+// their digits anyway, so "number" holds the value of TOKEN_NUMBER tokens.
 typedef struct
 {
     const char *start;
     int length;
     TokenType type;
     int line;
+    double number;
 } Token;
 
-void init_scanner(const char *source);
+void init_scanner(const char *source, size_t length);
 Token scan_token();
 
 #endif
\ No newline at end of file
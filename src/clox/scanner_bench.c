@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+// scanner_bench measures the scanner's throughput in tokens per second. It scans a Lox file, or when
+// no file is given a generated program of about 64MB, a number of times and reports the best run:
+//   make bench && ./scanner_bench [path] [iterations]
+
+static const char *sample =
+    "// compute some totals over the orders\n"
+    "var total_price = 0;\n"
+    "for (var index = 0; index < order_count; index = index + 1) {\n"
+    "    var description = \"order number \" + index;\n"
+    "    if (index >= 10 and discount != nil) {\n"
+    "        total_price = total_price + 12.75 * quantity - discount;\n"
+    "    } else {\n"
+    "        print \"no discount for this order\";\n"
+    "    }\n"
+    "}\n"
+    "fun shipping(weight, distance) {\n"
+    "    return weight * 0.35 + distance / 1000;\n"
+    "}\n"
+    "\n";
+
+static char *generate_source(size_t target_size, size_t *length)
+{
+    size_t sample_length = strlen(sample);
+    size_t copies = target_size / sample_length + 1;
+    char *source = malloc(copies * sample_length + 1);
+    for (size_t i = 0; i < copies; i++)
+    {
+        memcpy(source + i * sample_length, sample, sample_length);
+    }
+    *length = copies * sample_length;
+    source[*length] = '\0';
+    return source;
+}
+
+static char *read_source(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    fseek(file, 0L, SEEK_END);
+    size_t file_size = ftell(file);
+    rewind(file);
+
+    char *source = malloc(file_size + 1);
+    *length = fread(source, sizeof(char), file_size, file);
+    source[*length] = '\0';
+    fclose(file);
+    return source;
+}
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, const char *argv[])
+{
+    size_t length;
+    char *source = argc > 1 ? read_source(argv[1], &length) : generate_source(64 * 1024 * 1024, &length);
+    int iterations = argc > 2 ? atoi(argv[2]) : 5;
+
+    double best = -1;
+    long tokens = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        double start = now();
+        init_scanner(source, length);
+        tokens = 0;
+        for (;;)
+        {
+            Token token = scan_token();
+            tokens++;
+            if (token.type == TOKEN_EOF)
+                break;
+        }
+        double elapsed = now() - start;
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    printf("%ld tokens, %.1f MB in %.3f s: %.1f M tokens/s, %.1f MB/s\n", tokens, length / 1e6, best,
+           tokens / best / 1e6, length / best / 1e6);
+    free(source);
+    return 0;
+}
\ No newline at end of file
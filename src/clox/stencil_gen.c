@@ -0,0 +1,191 @@
+#include <elf.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// stencil_gen extracts the JIT's stencils from the object file stencils.c compiles to, and prints them as
+// C arrays for jit.c to include (see the Makefile):
+//   ./stencil_gen stencils.o > stencils.h
+// Each stencil_<name> function in its own section becomes the bytes of its code, and the relocations in it
+// become the places the JIT patches when it copies the code: the JIT_* holes, the jumps to the next
+// instruction and to jump targets, and the addresses of the runtime functions the stencil calls. A
+// stencil's last instruction is usually the jump to the next instruction, which is dropped, so the next
+// stencil's code just follows
+
+#define SECTION_PREFIX ".text.stencil_"
+
+// the most stencils stencils.c can define
+#define STENCILS_MAX 256
+
+static const unsigned char *object;
+static Elf64_Shdr *sections;
+static const char *section_names;
+
+static void fail(const char *message, const char *detail)
+{
+    fprintf(stderr, "stencil_gen: %s%s\n", message, detail);
+    exit(1);
+}
+
+static unsigned char *read_object(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        fail("can't open ", path);
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    unsigned char *bytes = malloc(size);
+    if (bytes == NULL || fread(bytes, 1, size, file) != (size_t)size)
+        fail("can't read ", path);
+    fclose(file);
+    return bytes;
+}
+
+// hole_kind is the kind of patch for a relocation against symbol, see StencilHole in jit.c
+static const char *hole_kind(const char *symbol)
+{
+    static char kind[256];
+    if (strcmp(symbol, "jit_continue") == 0)
+        return "HOLE_CONTINUE";
+    if (strcmp(symbol, "jit_jump") == 0)
+        return "HOLE_JUMP";
+    if (strncmp(symbol, "JIT_", 4) == 0)
+    {
+        snprintf(kind, sizeof(kind), "HOLE_%s", symbol + 4);
+        return kind;
+    }
+    return "HOLE_ADDRESS";
+}
+
+static void print_stencil(int index, Elf64_Shdr *symtab)
+{
+    Elf64_Shdr *section = &sections[index];
+    const char *name = section_names + section->sh_name + strlen(".text.");
+    const unsigned char *code = object + section->sh_offset;
+    size_t size = section->sh_size;
+
+    Elf64_Sym *symbols = (Elf64_Sym *)(object + symtab->sh_offset);
+    const char *symbol_names = (const char *)(object + sections[symtab->sh_link].sh_offset);
+
+    // the relocations of this section, if it has any
+    Elf64_Rela *relocations = NULL;
+    size_t relocation_count = 0;
+    Elf64_Ehdr *header = (Elf64_Ehdr *)object;
+    for (int i = 0; i < header->e_shnum; i++)
+    {
+        if (sections[i].sh_type == SHT_RELA && sections[i].sh_info == (Elf64_Word)index)
+        {
+            relocations = (Elf64_Rela *)(object + sections[i].sh_offset);
+            relocation_count = sections[i].sh_size / sizeof(Elf64_Rela);
+        }
+    }
+
+    // drop the final "jmp jit_continue", its relocation is the last one in the section
+    bool falls_through = false;
+    if (relocation_count > 0 && size >= 5 && code[size - 5] == 0xe9)
+    {
+        Elf64_Rela *last = &relocations[relocation_count - 1];
+        const char *symbol = symbol_names + symbols[ELF64_R_SYM(last->r_info)].st_name;
+        if (last->r_offset == size - 4 && strcmp(symbol, "jit_continue") == 0)
+        {
+            size -= 5;
+            relocation_count--;
+            falls_through = true;
+        }
+    }
+
+    printf("static const uint8_t %s_code[] = {", name);
+    for (size_t i = 0; i < size; i++)
+        printf("%s0x%02x,", i % 16 == 0 ? "\n    " : " ", code[i]);
+    printf("\n};\n");
+
+    if (relocation_count > 0)
+    {
+        printf("static const StencilPatch %s_patches[] = {\n", name);
+        for (size_t i = 0; i < relocation_count; i++)
+        {
+            Elf64_Rela *relocation = &relocations[i];
+            Elf64_Sym *symbol = &symbols[ELF64_R_SYM(relocation->r_info)];
+            const char *symbol_name = symbol_names + symbol->st_name;
+            // anything but holes and functions, e.g. a constant the compiler put into .rodata, can't be
+            // patched, stencils.c has to do without it
+            if (ELF64_ST_TYPE(symbol->st_info) == STT_SECTION || symbol->st_shndx != SHN_UNDEF)
+                fail("stencil refers to data in the object file: ", name);
+
+            bool relative;
+            switch (ELF64_R_TYPE(relocation->r_info))
+            {
+            case R_X86_64_64:
+                relative = false;
+                break;
+            case R_X86_64_PC32:
+            case R_X86_64_PLT32:
+                relative = true;
+                break;
+            default:
+                fail("unsupported relocation in ", name);
+            }
+
+            const char *kind = hole_kind(symbol_name);
+            printf("    {%lu, %s, %s, %ld, ", (unsigned long)relocation->r_offset, kind, relative ? "true" : "false",
+                   (long)relocation->r_addend);
+            if (strcmp(kind, "HOLE_ADDRESS") == 0)
+                printf("(const void *)&%s},\n", symbol_name);
+            else
+                printf("NULL},\n");
+        }
+        printf("};\n");
+    }
+    printf("static const Stencil %s = {%s_code, sizeof(%s_code), %s%s, %lu, %s};\n\n", name, name, name,
+           relocation_count > 0 ? name : "NULL", relocation_count > 0 ? "_patches" : "",
+           (unsigned long)relocation_count, falls_through ? "true" : "false");
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: stencil_gen stencils.o\n");
+        return 64;
+    }
+
+    object = read_object(argv[1]);
+    Elf64_Ehdr *header = (Elf64_Ehdr *)object;
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64 ||
+        header->e_machine != EM_X86_64)
+        fail("not an x86-64 ELF object file: ", argv[1]);
+
+    sections = (Elf64_Shdr *)(object + header->e_shoff);
+    section_names = (const char *)(object + sections[header->e_shstrndx].sh_offset);
+    Elf64_Shdr *symtab = NULL;
+    for (int i = 0; i < header->e_shnum; i++)
+    {
+        if (sections[i].sh_type == SHT_SYMTAB)
+            symtab = &sections[i];
+    }
+    if (symtab == NULL)
+        fail("no symbol table in ", argv[1]);
+
+    printf("// generated by stencil_gen from %s, don't edit\n\n", argv[1]);
+    const char *opcodes[STENCILS_MAX];
+    int opcode_count = 0;
+    for (int i = 0; i < header->e_shnum; i++)
+    {
+        const char *name = section_names + sections[i].sh_name;
+        if (sections[i].sh_type != SHT_PROGBITS || strncmp(name, SECTION_PREFIX, strlen(SECTION_PREFIX)) != 0)
+            continue;
+        print_stencil(i, symtab);
+        // the stencils named after an opcode are the code of that instruction
+        const char *stencil = name + strlen(SECTION_PREFIX);
+        if (strncmp(stencil, "OP_", 3) == 0 && opcode_count < STENCILS_MAX)
+            opcodes[opcode_count++] = stencil;
+    }
+
+    printf("static const Stencil *const opcode_stencils[] = {\n");
+    for (int i = 0; i < opcode_count; i++)
+        printf("    [%s] = &stencil_%s,\n", opcodes[i], opcodes[i]);
+    printf("};\n");
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,379 @@
+#include <string.h>
+
+#include "jit.h"
+#include "object.h"
+#include "vm.h"
+
+// the stencils the JIT copies the machine code of each instruction from. This file is never linked into
+// clox: the Makefile compiles it on its own, and stencil_gen extracts each stencil's code into stencils.h,
+// along with the places in it that jit.c patches when it copies it. Each stencil does what run() does for
+// its instruction, so they have to be kept in step with the interpreter.
+//
+// A stencil gets the frame, the stack top and the frame's slots, and continues with the next instruction
+// by tail-calling jit_continue (or a jump target by tail-calling jit_jump), which become plain jumps. The
+// operands are the addresses of the JIT_* symbols, which are never defined: they're holes jit.c fills in
+// with the actual operands. An instruction that needs the interpreter (for an error, or a type the
+// stencil doesn't handle) returns its offset instead, before it has had any effect on the VM.
+//
+// Stencils can't refer to anything in this file's data, e.g. a constant gcc puts into .rodata, only to the
+// holes and to clox's own functions and globals; stencil_gen fails on anything else
+
+extern char JIT_OPERAND_A[];
+extern char JIT_OPERAND_B[];
+extern char JIT_OPERAND_C[];
+extern char JIT_OFFSET[];
+extern char JIT_CONSTANTS[];
+extern char JIT_CACHES[];
+
+int jit_continue(CallFrame *frame, Value *stack_top, Value *slots);
+int jit_jump(CallFrame *frame, Value *stack_top, Value *slots);
+
+#define STENCIL(name) int stencil_##name(CallFrame *frame, Value *stack_top, Value *slots)
+#define CONTINUE(top) return jit_continue(frame, top, slots)
+#define JUMP(top) return jit_jump(frame, top, slots)
+// EXIT leaves the instruction to the interpreter
+#define EXIT(top)                          \
+    do                                     \
+    {                                      \
+        vm.stack_top = top;                \
+        return (int)(uintptr_t)JIT_OFFSET; \
+    } while (false)
+
+#define OPERAND_A ((uintptr_t)JIT_OPERAND_A)
+#define OPERAND_B ((uintptr_t)JIT_OPERAND_B)
+#define OPERAND_C ((uintptr_t)JIT_OPERAND_C)
+#define CONSTANTS ((Value *)JIT_CONSTANTS)
+#define CACHES ((PropertyCache *)JIT_CACHES)
+
+// the runtime calls get an up to date vm.stack_top, and may change it
+#define SYNC_OUT() (vm.stack_top = stack_top)
+#define SYNC_IN() (stack_top = vm.stack_top)
+
+static inline __attribute__((always_inline)) bool is_falsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+STENCIL(exit)
+{
+    EXIT(stack_top);
+}
+
+STENCIL(OP_CONSTANT)
+{
+    stack_top[0] = CONSTANTS[OPERAND_A];
+    CONTINUE(stack_top + 1);
+}
+
+STENCIL(OP_CONSTANT_LONG)
+{
+    stack_top[0] = CONSTANTS[OPERAND_A | (OPERAND_B << 8) | (OPERAND_C << 16)];
+    CONTINUE(stack_top + 1);
+}
+
+STENCIL(OP_NIL)
+{
+    stack_top[0] = NIL_VAL;
+    CONTINUE(stack_top + 1);
+}
+
+STENCIL(OP_TRUE)
+{
+    stack_top[0] = BOOL_VAL(true);
+    CONTINUE(stack_top + 1);
+}
+
+STENCIL(OP_FALSE)
+{
+    stack_top[0] = BOOL_VAL(false);
+    CONTINUE(stack_top + 1);
+}
+
+STENCIL(OP_POP)
+{
+    CONTINUE(stack_top - 1);
+}
+
+STENCIL(OP_GET_LOCAL)
+{
+    stack_top[0] = slots[OPERAND_A];
+    CONTINUE(stack_top + 1);
+}
+
+STENCIL(OP_SET_LOCAL)
+{
+    slots[OPERAND_A] = stack_top[-1];
+    CONTINUE(stack_top);
+}
+
+STENCIL(OP_STORE_LOCAL)
+{
+    slots[OPERAND_A] = stack_top[-1];
+    CONTINUE(stack_top - 1);
+}
+
+STENCIL(OP_GET_UPVALUE)
+{
+    stack_top[0] = *frame->upvalues[OPERAND_A]->location;
+    CONTINUE(stack_top + 1);
+}
+
+STENCIL(OP_SET_UPVALUE)
+{
+    write_barrier(*frame->upvalues[OPERAND_A]->location);
+    *frame->upvalues[OPERAND_A]->location = stack_top[-1];
+    CONTINUE(stack_top);
+}
+
+STENCIL(OP_DEFINE_GLOBAL)
+{
+    SYNC_OUT();
+    jit_define_global(AS_STRING(CONSTANTS[OPERAND_A]));
+    SYNC_IN();
+    CONTINUE(stack_top);
+}
+
+STENCIL(OP_GET_GLOBAL)
+{
+    SYNC_OUT();
+    // an undefined variable is an error
+    if (!jit_get_global(AS_STRING(CONSTANTS[OPERAND_A])))
+        EXIT(stack_top);
+    SYNC_IN();
+    CONTINUE(stack_top);
+}
+
+STENCIL(OP_SET_GLOBAL)
+{
+    SYNC_OUT();
+    if (!jit_set_global(AS_STRING(CONSTANTS[OPERAND_A])))
+        EXIT(stack_top);
+    CONTINUE(stack_top);
+}
+
+STENCIL(OP_GET_PROPERTY)
+{
+    SYNC_OUT();
+    // a method, or an error, is up to the interpreter
+    if (!get_field_cached(AS_STRING(CONSTANTS[OPERAND_A]), &CACHES[(OPERAND_B << 8) | OPERAND_C]))
+        EXIT(stack_top);
+    CONTINUE(stack_top);
+}
+
+STENCIL(OP_SET_PROPERTY)
+{
+    SYNC_OUT();
+    if (!set_property_cached(AS_STRING(CONSTANTS[OPERAND_A]), &CACHES[(OPERAND_B << 8) | OPERAND_C]))
+        EXIT(stack_top);
+    CONTINUE(stack_top - 1);
+}
+
+// NUMBER_OP replaces the two numbers on top of the stack with "left op right", anything else is up to
+// the interpreter
+#define NUMBER_OP(value_type, op)                                     \
+    if (!IS_NUMBER(stack_top[-1]) || !IS_NUMBER(stack_top[-2]))       \
+        EXIT(stack_top);                                              \
+    stack_top[-2] = value_type(AS_NUMBER(stack_top[-2]) op AS_NUMBER(stack_top[-1])); \
+    CONTINUE(stack_top - 1);
+
+// ADD is NUMBER_OP with a way out for strings, for OP_ADD and its quickened forms
+#define ADD()                                                                        \
+    if (IS_NUMBER(stack_top[-1]) && IS_NUMBER(stack_top[-2]))                        \
+    {                                                                                \
+        stack_top[-2] = NUMBER_VAL(AS_NUMBER(stack_top[-2]) + AS_NUMBER(stack_top[-1])); \
+        CONTINUE(stack_top - 1);                                                     \
+    }                                                                                \
+    SYNC_OUT();                                                                      \
+    if (!jit_add())                                                                  \
+        EXIT(stack_top);                                                             \
+    CONTINUE(stack_top - 1);
+
+STENCIL(OP_ADD)
+{
+    ADD()
+}
+
+STENCIL(OP_ADD_NUMBER)
+{
+    ADD()
+}
+
+STENCIL(OP_ADD_STRING)
+{
+    ADD()
+}
+
+STENCIL(OP_ADD_GENERIC)
+{
+    ADD()
+}
+
+STENCIL(OP_SUBTRACT)
+{
+    NUMBER_OP(NUMBER_VAL, -)
+}
+
+STENCIL(OP_MULTIPLY)
+{
+    NUMBER_OP(NUMBER_VAL, *)
+}
+
+STENCIL(OP_DIVIDE)
+{
+    NUMBER_OP(NUMBER_VAL, /)
+}
+
+STENCIL(OP_GREATER)
+{
+    NUMBER_OP(BOOL_VAL, >)
+}
+
+STENCIL(OP_LESS)
+{
+    NUMBER_OP(BOOL_VAL, <)
+}
+
+STENCIL(OP_NEGATE)
+{
+    if (!IS_NUMBER(stack_top[-1]))
+        EXIT(stack_top);
+    // flip the sign bit. A plain negation needs a mask constant in .rodata
+    uint64_t bits;
+    memcpy(&bits, &stack_top[-1].as.number, sizeof(bits));
+    bits ^= (uint64_t)1 << 63;
+    memcpy(&stack_top[-1].as.number, &bits, sizeof(bits));
+    CONTINUE(stack_top);
+}
+
+STENCIL(OP_NOT)
+{
+    stack_top[-1] = BOOL_VAL(is_falsey(stack_top[-1]));
+    CONTINUE(stack_top);
+}
+
+STENCIL(OP_EQUAL)
+{
+    stack_top[-2] = BOOL_VAL(value_equals(stack_top[-2], stack_top[-1]));
+    CONTINUE(stack_top - 1);
+}
+
+STENCIL(OP_PRINT)
+{
+    SYNC_OUT();
+    jit_print();
+    CONTINUE(stack_top - 1);
+}
+
+STENCIL(OP_JUMP)
+{
+    JUMP(stack_top);
+}
+
+// a loop in machine code never gets to the interpreter's safepoints, so it burns the fuel itself, and
+// leaves the loop to the interpreter once the safepoint has something to do (see SAFEPOINT in vm.c)
+STENCIL(OP_LOOP)
+{
+    if (vm.safepoint_requested || vm.fuel <= 0)
+        EXIT(stack_top);
+    vm.fuel--;
+    JUMP(stack_top);
+}
+
+STENCIL(OP_JUMP_IF_FALSE)
+{
+    if (is_falsey(stack_top[-1]))
+        JUMP(stack_top);
+    CONTINUE(stack_top);
+}
+
+STENCIL(OP_POP_JUMP_IF_FALSE)
+{
+    if (is_falsey(stack_top[-1]))
+        JUMP(stack_top - 1);
+    CONTINUE(stack_top - 1);
+}
+
+// COMPARE_JUMP pops two numbers, left and right, and jumps if condition holds for them
+#define COMPARE_JUMP(condition)                                   \
+    if (!IS_NUMBER(stack_top[-1]) || !IS_NUMBER(stack_top[-2]))   \
+        EXIT(stack_top);                                          \
+    double right = AS_NUMBER(stack_top[-1]);                      \
+    double left = AS_NUMBER(stack_top[-2]);                       \
+    if (condition)                                                \
+        JUMP(stack_top - 2);                                      \
+    CONTINUE(stack_top - 2);
+
+STENCIL(OP_JUMP_IF_NOT_LESS)
+{
+    COMPARE_JUMP(!(left < right))
+}
+
+STENCIL(OP_JUMP_IF_NOT_GREATER)
+{
+    COMPARE_JUMP(!(left > right))
+}
+
+STENCIL(OP_JUMP_IF_GREATER)
+{
+    COMPARE_JUMP(left > right)
+}
+
+STENCIL(OP_JUMP_IF_LESS)
+{
+    COMPARE_JUMP(left < right)
+}
+
+STENCIL(OP_JUMP_IF_NOT_EQUAL)
+{
+    if (!value_equals(stack_top[-2], stack_top[-1]))
+        JUMP(stack_top - 2);
+    CONTINUE(stack_top - 2);
+}
+
+STENCIL(OP_JUMP_IF_EQUAL)
+{
+    if (value_equals(stack_top[-2], stack_top[-1]))
+        JUMP(stack_top - 2);
+    CONTINUE(stack_top - 2);
+}
+
+// REGISTER_OP is a register form of arithmetic: the left operand is local A (B with a destination in A),
+// the right one a local or a constant. Strings and type errors are up to the interpreter
+#define REGISTER_OP(op, has_dst, constant_operand)                                                    \
+    Value left = slots[has_dst ? OPERAND_B : OPERAND_A];                                              \
+    Value right = constant_operand ? CONSTANTS[has_dst ? OPERAND_C : OPERAND_B]                       \
+                                   : slots[has_dst ? OPERAND_C : OPERAND_B];                          \
+    if (!IS_NUMBER(left) || !IS_NUMBER(right))                                                        \
+        EXIT(stack_top);                                                                              \
+    Value result = NUMBER_VAL(AS_NUMBER(left) op AS_NUMBER(right));                                   \
+    if (has_dst)                                                                                      \
+    {                                                                                                 \
+        slots[OPERAND_A] = result;                                                                    \
+        CONTINUE(stack_top);                                                                          \
+    }                                                                                                 \
+    stack_top[0] = result;                                                                            \
+    CONTINUE(stack_top + 1);
+
+// REGISTER_STENCILS defines the four forms of a group
+#define REGISTER_STENCILS(group, op) \
+    STENCIL(group##_LL)              \
+    {                                \
+        REGISTER_OP(op, false, false) \
+    }                                \
+    STENCIL(group##_LK)              \
+    {                                \
+        REGISTER_OP(op, false, true) \
+    }                                \
+    STENCIL(group##_LL_TO)           \
+    {                                \
+        REGISTER_OP(op, true, false) \
+    }                                \
+    STENCIL(group##_LK_TO)           \
+    {                                \
+        REGISTER_OP(op, true, true)  \
+    }
+
+REGISTER_STENCILS(OP_ADD, +)
+REGISTER_STENCILS(OP_SUBTRACT, -)
+REGISTER_STENCILS(OP_MULTIPLY, *)
+REGISTER_STENCILS(OP_DIVIDE, /)
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
 #define TABLE_MAX_LOAD 0.75
 
@@ -17,7 +18,7 @@ void init_table(Table *table)
 
 void free_table(Table *table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(Entry, table->entries, table->capacity, MEM_TABLE_ENTRIES);
     init_table(table);
 }
 
@@ -60,7 +61,7 @@ Entry *find_entry(Entry *entries, int capacity, ObjString *key)
 // entries
 static void adjust_capacity(Table *table, int capacity)
 {
-    Entry *entries = ALLOCATE(Entry, capacity);
+    Entry *entries = ALLOCATE(Entry, capacity, MEM_TABLE_ENTRIES);
     for (int i = 0; i < capacity; i++)
     {
         entries[i].key = NULL;
@@ -83,7 +84,7 @@ static void adjust_capacity(Table *table, int capacity)
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(Entry, table->entries, table->capacity, MEM_TABLE_ENTRIES);
 
     table->entries = entries;
     table->capacity = capacity;
@@ -102,6 +103,8 @@ bool table_set(Table *table, ObjString *key, Value value)
     // only increment if filling an actually empty entry, not tombstone
     if (is_new_key && IS_NIL(entry->value))
         table->count++;
+    else if (!is_new_key)
+        write_barrier(entry->value);
 
     entry->key = key;
     entry->value = value;
@@ -156,6 +159,8 @@ bool table_delete(Table *table, ObjString *key)
     if (entry->key == NULL)
         return false;
 
+    write_barrier(OBJ_VAL(entry->key));
+    write_barrier(entry->value);
     // tombstone
     entry->key = NULL;
     entry->value = BOOL_VAL(true);
@@ -163,26 +168,104 @@ bool table_delete(Table *table, ObjString *key)
     return true;
 }
 
-ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash)
+void init_string_set(StringSet *set)
 {
-    if (table->count == 0)
-        return NULL;
-    uint32_t index = hash % table->capacity;
+    set->count = 0;
+    set->tombstones = 0;
+    set->capacity = 0;
+    set->strings = NULL;
+    set->hashes = NULL;
+}
 
-    for (;;)
+void free_string_set(StringSet *set)
+{
+    FREE_ARRAY(ObjString *, set->strings, set->capacity, MEM_STRING_SET);
+    FREE_ARRAY(uint32_t, set->hashes, set->capacity, MEM_STRING_SET);
+    init_string_set(set);
+}
+
+// a string the collector frees leaves a tombstone in its slot, so the probe sequences going through the
+// slot aren't cut short. Its length never matches, so string_set_find skips it
+static ObjString tombstone = {.length = -1};
+#define TOMBSTONE (&tombstone)
+
+// string_set_insert puts string into the first free slot, which the caller has made sure there is
+static void string_set_insert(StringSet *set, ObjString *string)
+{
+    uint32_t mask = set->capacity - 1;
+    uint32_t index = string->hash & mask;
+    while (set->strings[index] != NULL && set->strings[index] != TOMBSTONE)
+        index = (index + 1) & mask;
+    if (set->strings[index] == TOMBSTONE)
+        set->tombstones--;
+    set->count++;
+    set->strings[index] = string;
+    set->hashes[index] = string->hash;
+}
+
+void string_set_add(StringSet *set, ObjString *string)
+{
+    // like in Table, the tombstones count towards the load, as probes have to go past them
+    if (set->count + set->tombstones + 1 > set->capacity * TABLE_MAX_LOAD)
     {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL)
+        ObjString **strings = set->strings;
+        uint32_t *hashes = set->hashes;
+        int capacity = set->capacity;
+        // strings come and go all the time, and when most of the load is tombstones, clearing them out makes
+        // room enough. Growing every time would size the set by all the strings ever interned
+        set->capacity = set->tombstones > set->count ? capacity : GROW_CAPACITY(capacity);
+        set->strings = ALLOCATE(ObjString *, set->capacity, MEM_STRING_SET);
+        set->hashes = ALLOCATE(uint32_t, set->capacity, MEM_STRING_SET);
+        for (int i = 0; i < set->capacity; i++)
+            set->strings[i] = NULL;
+        // the tombstones are left behind
+        set->count = 0;
+        set->tombstones = 0;
+        for (int i = 0; i < capacity; i++)
         {
-            if (IS_NIL(entry->value))
-            {
-                return NULL;
-            }
+            if (strings[i] != NULL && strings[i] != TOMBSTONE)
+                string_set_insert(set, strings[i]);
         }
-        else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0)
+        FREE_ARRAY(ObjString *, strings, capacity, MEM_STRING_SET);
+        FREE_ARRAY(uint32_t, hashes, capacity, MEM_STRING_SET);
+    }
+    string_set_insert(set, string);
+}
+
+ObjString *string_set_find(StringSet *set, const char *chars, int length, uint32_t hash)
+{
+    if (set->count == 0)
+        return NULL;
+    uint32_t mask = set->capacity - 1;
+    uint32_t index = hash & mask;
+
+    for (;;)
+    {
+        ObjString *string = set->strings[index];
+        if (string == NULL)
+            return NULL;
+        if (set->hashes[index] == hash && string->length == length && memcmp(string->chars, chars, length) == 0)
+            return string;
+        index = (index + 1) & mask;
+    }
+}
+
+void string_set_remove(StringSet *set, ObjString *string)
+{
+    if (set->count == 0)
+        return;
+    uint32_t mask = set->capacity - 1;
+    uint32_t index = string->hash & mask;
+
+    while (set->strings[index] != NULL)
+    {
+        if (set->strings[index] == string)
         {
-            return entry->key;
+            set->strings[index] = TOMBSTONE;
+            set->count--;
+            set->tombstones++;
+            return;
         }
-        index = (index + 1) % table->capacity;
+        index = (index + 1) & mask;
     }
 }
\ No newline at end of file
@@ -27,5 +27,26 @@ bool table_set(Table *table, ObjString *key, Value value);
 void table_add_all(Table *from, Table *to);
 bool table_get(Table *table, ObjString *key, Value *value);
 bool table_delete(Table *table, ObjString *key);
-ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash);
+
+// StringSet is the set of interned strings. It's a hash table like Table, but with keys only, so an
+// entry takes 12 bytes instead of 24: the string, and its hash in a parallel array, so a probe can skip
+// the strings that can't match without touching them. The capacity is a power of two
+typedef struct
+{
+    // count is the strings in the set, tombstones the slots freed strings left behind. Both take up room
+    int count;
+    int tombstones;
+    int capacity;
+    ObjString **strings;
+    uint32_t *hashes;
+} StringSet;
+
+void init_string_set(StringSet *set);
+void free_string_set(StringSet *set);
+// string_set_add adds a string that isn't in the set yet
+void string_set_add(StringSet *set, ObjString *string);
+// string_set_find returns the string in the set with these chars, or NULL if there isn't one
+ObjString *string_set_find(StringSet *set, const char *chars, int length, uint32_t hash);
+// string_set_remove takes a string the garbage collector frees out of the set
+void string_set_remove(StringSet *set, ObjString *string);
 #endif
\ No newline at end of file
@@ -1,15 +1,18 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "arena.h"
 #include "memory.h"
 #include "value.h"
 #include "object.h"
+#include "output.h"
 
 void init_value_array(ValueArray *array)
 {
     array->capacity = 0;
     array->count = 0;
     array->values = NULL;
+    array->arena = NULL;
 }
 
 void write_value_array(ValueArray *array, Value value)
@@ -18,7 +21,10 @@ void write_value_array(ValueArray *array, Value value)
     {
         int old_capacity = array->capacity;
         array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+        if (array->arena != NULL)
+            array->values = ARENA_GROW_ARRAY(array->arena, Value, array->values, old_capacity, array->capacity);
+        else
+            array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity, MEM_CONSTANTS);
     }
 
     array->values[array->count] = value;
@@ -27,7 +33,8 @@ void write_value_array(ValueArray *array, Value value)
 
 void free_value_array(ValueArray *array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    if (array->arena == NULL)
+        FREE_ARRAY(Value, array->values, array->capacity, MEM_CONSTANTS);
     init_value_array(array);
 }
 
@@ -36,13 +43,16 @@ void print_value(Value value)
     switch (value.type)
     {
     case VAL_NUMBER:
-        printf("%g", AS_NUMBER(value));
+        write_number(AS_NUMBER(value));
         break;
     case VAL_BOOL:
-        printf(AS_BOOL(value) ? "true" : "false");
+        if (AS_BOOL(value))
+            write_output("true", 4);
+        else
+            write_output("false", 5);
         break;
     case VAL_NIL:
-        printf("nil");
+        write_output("nil", 3);
         break;
     case VAL_OBJ:
         print_object(value);
@@ -64,10 +74,19 @@ bool value_equals(Value a, Value b)
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:
     {
-        // the only objects we currently have are strings and all Lox strings are interned
         // string interning gurantees that two identical strings
         // are stored in one unique place in memory (in vm's internal hash table)
-        return AS_OBJ(a) == AS_OBJ(b);
+        if (AS_OBJ(a) == AS_OBJ(b))
+            return true;
+        if (!IS_STRING(a) || !IS_STRING(b))
+            return false;
+        // but long strings built at runtime aren't interned (see take_string), and have to be compared by
+        // their chars. The hash is cached, so comparing against the same string again is quick to reject
+        ObjString *x = AS_STRING(a);
+        ObjString *y = AS_STRING(b);
+        if ((obj_flag(&x->obj, STRING_INTERNED) && obj_flag(&y->obj, STRING_INTERNED)) || x->length != y->length)
+            return false;
+        return string_hash(x) == string_hash(y) && memcmp(x->chars, y->chars, x->length) == 0;
     }
     default:
         return false;
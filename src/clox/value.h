@@ -6,6 +6,7 @@
 // abstract how we represent values in the C implementation of the bytecode and VM
 // this way, if we change it, the change is encapsulated to this module
 
+typedef struct Arena Arena;
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
@@ -47,6 +48,8 @@ typedef struct
     int capacity;
     int count;
     Value *values;
+    // the arena the array grows in, or NULL if it's on the heap
+    Arena *arena;
 } ValueArray;
 
 void init_value_array(ValueArray *array);
@@ -1,47 +1,166 @@
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "output.h"
+#include "jit.h"
 
 // vm is a single, global instance
 VM vm;
 
+// the guard pages right after the end of the stack and of the frames, and where a push into them ends up,
+// see guard_page_handler
+static char *stack_guard;
+static char *frames_guard;
+static size_t guard_size;
+static sigjmp_buf stack_overflow;
+static struct sigaction previous_segv_action;
+static struct sigaction previous_bus_action;
+
+static Value clock_native(int arg_count, Value *args)
+{
+    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+}
+
 static void reset_stack()
 {
     vm.stack_top = vm.stack;
+    vm.frame_count = 0;
+    vm.open_upvalues = NULL;
+}
+
+static void define_native(const char *name, NativeFn function, int arity)
+{
+    // both go on the stack first, so they are reachable while the table might be reallocated
+    push(OBJ_VAL(copy_string(name, (int)strlen(name))));
+    push(OBJ_VAL(new_native(function, arity)));
+    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    pop();
+    pop();
+}
+
+// guard_page_handler catches faults on the guard pages, i.e. a push past the end of the stack, and turns
+// them into a runtime error (see resume). Calls make sure the stack has room for the whole frame, and the
+// frames run out after the stack, so that takes a push the frame's max_stack doesn't account for, but it
+// ends the script cleanly instead of corrupting memory. Any other fault goes on to the previous handler,
+// which runs when the faulting instruction is retried
+static void guard_page_handler(int signal_number, siginfo_t *info, void *context)
+{
+    char *address = (char *)info->si_addr;
+    if ((address >= stack_guard && address < stack_guard + guard_size) ||
+        (address >= frames_guard && address < frames_guard + guard_size))
+        siglongjmp(stack_overflow, 1);
+    sigaction(signal_number, signal_number == SIGSEGV ? &previous_segv_action : &previous_bus_action, NULL);
+}
+
+// reserve maps size bytes of address space, followed by a guard page that can't be touched, which it
+// returns in guard. The OS only commits the pages a script actually uses, so they cost nothing up front
+static void *reserve(size_t size, char **guard)
+{
+    char *region = mmap(NULL, size + guard_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1, 0);
+    if (region == MAP_FAILED || mprotect(region + size, guard_size, PROT_NONE) != 0)
+    {
+        fprintf(stderr, "Could not reserve the VM stack.\n");
+        exit(1);
+    }
+    *guard = region + size;
+    return region;
+}
+
+// reserve_stack maps the stack, STACK_MAX values, and the frames, FRAMES_MAX of them, each followed by a
+// guard page
+static void reserve_stack()
+{
+    guard_size = (size_t)sysconf(_SC_PAGESIZE);
+    vm.stack = reserve(STACK_MAX * sizeof(Value), &stack_guard);
+    vm.frames = reserve(FRAMES_MAX * sizeof(CallFrame), &frames_guard);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guard_page_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    // some systems (e.g. macOS) report touching a protected page as a bus error
+    sigaction(SIGSEGV, &action, &previous_segv_action);
+    sigaction(SIGBUS, &action, &previous_bus_action);
 }
 
 void init_vm()
 {
+    reserve_stack();
     reset_stack();
+    init_output();
     vm.objects = NULL;
-    init_table(&vm.strings);
+    init_gc();
+    vm.fuel = FUEL_UNLIMITED;
+    vm.safepoint_requested = false;
+    vm.interrupted = false;
+    init_string_set(&vm.strings);
     init_table(&vm.globals);
+    vm.init_string = copy_string("init", 4);
+
+    define_native("clock", clock_native, 0);
 }
 
 void free_vm()
 {
     free_table(&vm.globals);
-    free_table(&vm.strings);
+    free_string_set(&vm.strings);
+    vm.init_string = NULL;
     free_objects();
+    sigaction(SIGSEGV, &previous_segv_action, NULL);
+    sigaction(SIGBUS, &previous_bus_action, NULL);
+    munmap(vm.stack, STACK_MAX * sizeof(Value) + guard_size);
+    munmap(vm.frames, FRAMES_MAX * sizeof(CallFrame) + guard_size);
+    vm.stack = NULL;
+    vm.frames = NULL;
 }
 
+// a stack trace shows at most this many of the innermost and of the outermost calls, a deep recursion
+// would print a line per call otherwise
+#define TRACE_END_FRAMES 10
+
 static void runtime_error(const char *format, ...)
 {
+    // whatever the program printed before the error should show up before the error message
+    flush_output();
+
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
+    // the stack trace, innermost call first. Each frame's ip is already past the failing instruction
+    for (int i = vm.frame_count - 1; i >= 0; i--)
+    {
+        if (i == vm.frame_count - 1 - TRACE_END_FRAMES && i >= TRACE_END_FRAMES)
+        {
+            fprintf(stderr, "[... %d more calls]\n", i - TRACE_END_FRAMES + 1);
+            i = TRACE_END_FRAMES - 1;
+        }
+        CallFrame *frame = &vm.frames[i];
+        ObjFunction *function = frame->function;
+        // after a stack overflow on the guard page, the innermost frame's ip can still be at the start
+        size_t instruction = frame->ip > function->chunk.code ? frame->ip - function->chunk.code - 1 : 0;
+        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        if (function->name == NULL)
+            fprintf(stderr, "script\n");
+        else
+            fprintf(stderr, "%s()\n", function->name->chars);
+    }
     reset_stack();
 }
 
@@ -65,27 +184,441 @@ static bool is_falsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+// warm_up counts a call of function, or an iteration of one of its loops, and compiles it to machine code
+// once it's hot
+static inline void warm_up(ObjFunction *function)
 {
-    ObjString *b = AS_STRING(pop());
-    ObjString *a = AS_STRING(pop());
+    if (function->jit == NULL && ++function->hotness == JIT_THRESHOLD)
+        jit_compile(function);
+}
+
+// ensure_stack makes sure function has all the stack it can use, when its frame starts at slots. It's the
+// only overflow check there is: once the frame is running, its pushes can't go past that
+static inline bool ensure_stack(Value *slots, ObjFunction *function)
+{
+    if (slots - vm.stack + function->max_stack > STACK_MAX)
+    {
+        runtime_error("Stack overflow.");
+        return false;
+    }
+    return true;
+}
+
+// call pushes a frame for function, whose arguments are already on the stack. It's the only work a
+// call does: the frames are preallocated and the arguments become the callee's first locals in place.
+// upvalues are the captured variables when calling a closure. There's no check for running out of frames,
+// the stack runs out first (see FRAMES_MAX)
+static bool call(ObjFunction *function, ObjUpvalue **upvalues, int arg_count)
+{
+    if (arg_count != function->arity)
+    {
+        runtime_error("Expected %d arguments but got %d.", function->arity, arg_count);
+        return false;
+    }
+
+    // -1 for the callee itself, which sits in slot zero
+    if (!ensure_stack(vm.stack_top - arg_count - 1, function))
+        return false;
+    CallFrame *frame = &vm.frames[vm.frame_count++];
+    frame->function = function;
+    frame->upvalues = upvalues;
+    frame->ip = function->chunk.code;
+    frame->slots = vm.stack_top - arg_count - 1;
+    warm_up(function);
+    return true;
+}
+
+static bool call_value(Value callee, int arg_count)
+{
+    if (IS_OBJ(callee))
+    {
+        switch (OBJ_TYPE(callee))
+        {
+        case OBJ_FUNCTION:
+            return call(AS_FUNCTION(callee), NULL, arg_count);
+        case OBJ_CLOSURE:
+        {
+            ObjClosure *closure = AS_CLOSURE(callee);
+            return call(closure->function, closure->upvalues, arg_count);
+        }
+        case OBJ_CLASS:
+        {
+            // the new instance takes the class's place below the arguments, where the initializer
+            // expects its receiver
+            ObjClass *klass = AS_CLASS(callee);
+            vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(klass));
+            Value initializer;
+            if (table_get(&klass->methods, vm.init_string, &initializer))
+                return call_value(initializer, arg_count);
+            if (arg_count != 0)
+            {
+                runtime_error("Expected 0 arguments but got %d.", arg_count);
+                return false;
+            }
+            return true;
+        }
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+            vm.stack_top[-arg_count - 1] = bound->receiver;
+            return call_value(bound->method, arg_count);
+        }
+        case OBJ_NATIVE:
+        {
+            ObjNative *native = (ObjNative *)AS_OBJ(callee);
+            if (arg_count != native->arity)
+            {
+                runtime_error("Expected %d arguments but got %d.", native->arity, arg_count);
+                return false;
+            }
+            // natives don't get a frame, they return straight away
+            Value result = native->function(arg_count, vm.stack_top - arg_count);
+            vm.stack_top -= arg_count + 1;
+            push(result);
+            return true;
+        }
+        default:
+            // non-callable object type
+            break;
+        }
+    }
+    runtime_error("Can only call functions and classes.");
+    return false;
+}
+
+// capture_upvalue returns the upvalue for the variable in local, reusing the open one if another
+// closure captured the variable already
+static ObjUpvalue *capture_upvalue(Value *local)
+{
+    ObjUpvalue *prev_upvalue = NULL;
+    ObjUpvalue *upvalue = vm.open_upvalues;
+    while (upvalue != NULL && upvalue->location > local)
+    {
+        prev_upvalue = upvalue;
+        upvalue = upvalue->next;
+    }
+
+    if (upvalue != NULL && upvalue->location == local)
+        return upvalue;
+
+    ObjUpvalue *created_upvalue = new_upvalue(local);
+    created_upvalue->next = upvalue;
+    if (prev_upvalue == NULL)
+        vm.open_upvalues = created_upvalue;
+    else
+        prev_upvalue->next = created_upvalue;
+    return created_upvalue;
+}
+
+// close_upvalues closes every open upvalue for a slot at or above last, i.e. the variables that are
+// about to be popped. Only captured variables ever have an upvalue, so when nothing in the frame was
+// captured this is a single comparison
+static void close_upvalues(Value *last)
+{
+    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last)
+    {
+        ObjUpvalue *upvalue = vm.open_upvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        vm.open_upvalues = upvalue->next;
+    }
+}
+
+// bind_method replaces the instance on top of the stack with its method called name
+static bool bind_method(ObjClass *klass, ObjString *name)
+{
+    Value method;
+    if (!table_get(&klass->methods, name, &method))
+    {
+        runtime_error("Undefined property '%s'.", name->chars);
+        return false;
+    }
 
+    ObjBoundMethod *bound = new_bound_method(peek(0), method);
+    pop();
+    push(OBJ_VAL(bound));
+    return true;
+}
+
+static void define_method(ObjString *name)
+{
+    Value method = peek(0);
+    ObjClass *klass = AS_CLASS(peek(1));
+    table_set(&klass->methods, name, method);
+    pop();
+}
+
+static inline PropertyCacheEntry *find_cache_entry(PropertyCache *cache, Shape *shape)
+{
+    for (int i = 0; i < cache->count; i++)
+    {
+        if (cache->entries[i].shape == shape)
+            return &cache->entries[i];
+    }
+    return NULL;
+}
+
+static void add_cache_entry(PropertyCache *cache, Shape *shape, Shape *transition, int index)
+{
+    if (cache->count == PROPERTY_CACHE_WAYS)
+        return;
+
+    PropertyCacheEntry *entry = &cache->entries[cache->count++];
+    entry->shape = shape;
+    entry->transition = transition;
+    entry->index = index;
+}
+
+// get_field_slow looks the field up in the instance's shape, and caches where it was found. It
+// returns -1 if the instance doesn't have that field
+static int get_field_slow(ObjInstance *instance, ObjString *name, PropertyCache *cache)
+{
+    int index = shape_find_field(instance->shape, name);
+    if (index >= 0)
+        add_cache_entry(cache, instance->shape, instance->shape, index);
+    return index;
+}
+
+// set_field stores value in field index, moving the instance to the transition shape if that adds it
+static inline void set_field(ObjInstance *instance, Shape *transition, int index, Value value)
+{
+    if (instance->shape != transition)
+    {
+        instance_reserve_fields(instance, transition->field_count);
+        instance->shape = transition;
+    }
+    else
+    {
+        write_barrier(instance->fields[index]);
+    }
+    instance->fields[index] = value;
+}
+
+static void set_field_slow(ObjInstance *instance, ObjString *name, Value value, PropertyCache *cache)
+{
+    Shape *transition = instance->shape;
+    int index = shape_find_field(instance->shape, name);
+    if (index < 0)
+    {
+        transition = shape_transition(instance->shape, name);
+        index = transition->field_count - 1;
+    }
+    add_cache_entry(cache, instance->shape, transition, index);
+    set_field(instance, transition, index, value);
+}
+
+// get_field_cached replaces the instance on top of the stack with its field called name. It returns false,
+// leaving the stack alone, if it isn't an instance or has no such field (but maybe a method)
+bool get_field_cached(ObjString *name, PropertyCache *cache)
+{
+    if (!IS_INSTANCE(peek(0)))
+        return false;
+
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    PropertyCacheEntry *entry = find_cache_entry(cache, instance->shape);
+    int index = entry != NULL ? entry->index : get_field_slow(instance, name, cache);
+    if (index < 0)
+        return false;
+    vm.stack_top[-1] = instance->fields[index];
+    return true;
+}
+
+// set_property_cached stores the value on top of the stack in the field called name of the instance below
+// it, and leaves the value in place of both. It returns false, leaving the stack alone, if there's no instance
+bool set_property_cached(ObjString *name, PropertyCache *cache)
+{
+    if (!IS_INSTANCE(peek(1)))
+        return false;
+
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+    Value value = peek(0);
+    PropertyCacheEntry *entry = find_cache_entry(cache, instance->shape);
+    if (entry != NULL)
+        set_field(instance, entry->transition, entry->index, value);
+    else
+        set_field_slow(instance, name, value, cache);
+
+    // the assignment evaluates to the assigned value
+    vm.stack_top -= 2;
+    push(value);
+    return true;
+}
+
+// call_method calls a method, which is either a plain function or a closure, with the receiver and the
+// arguments already in place
+static inline bool call_method(Value method, int arg_count)
+{
+    if (IS_CLOSURE(method))
+        return call(AS_CLOSURE(method)->function, AS_CLOSURE(method)->upvalues, arg_count);
+    return call(AS_FUNCTION(method), NULL, arg_count);
+}
+
+static inline MethodCacheEntry *find_method_entry(MethodCache *cache, void *key)
+{
+    for (int i = 0; i < cache->count; i++)
+    {
+        if (cache->entries[i].key == key)
+            return &cache->entries[i];
+    }
+    return NULL;
+}
+
+static void add_method_entry(MethodCache *cache, void *key, Value method)
+{
+    if (cache->count == METHOD_CACHE_WAYS)
+        return;
+
+    MethodCacheEntry *entry = &cache->entries[cache->count++];
+    entry->key = key;
+    entry->method = method;
+}
+
+// invoke_from_class calls the method called name of klass, without binding it to the receiver first
+static bool invoke_from_class(ObjClass *klass, ObjString *name, int arg_count, MethodCache *cache, void *key)
+{
+    Value method;
+    if (!table_get(&klass->methods, name, &method))
+    {
+        runtime_error("Undefined property '%s'.", name->chars);
+        return false;
+    }
+    add_method_entry(cache, key, method);
+    return call_method(method, arg_count);
+}
+
+// invoke is "receiver.name(args)". The method is found in the cache by the receiver's shape; when it
+// isn't there, it might be a field holding something callable rather than a method
+static inline bool invoke(ObjInstance *instance, ObjString *name, int arg_count, MethodCache *cache)
+{
+    MethodCacheEntry *entry = find_method_entry(cache, instance->shape);
+    if (entry != NULL)
+        return call_method(entry->method, arg_count);
+
+    int index = shape_find_field(instance->shape, name);
+    if (index >= 0)
+    {
+        Value field = instance->fields[index];
+        vm.stack_top[-arg_count - 1] = field;
+        return call_value(field, arg_count);
+    }
+    return invoke_from_class(instance->klass, name, arg_count, cache, instance->shape);
+}
+
+// join_strings makes the string a followed by b. Allocating never collects (that waits for a safepoint),
+// so a and b don't have to be anywhere the collector looks
+static ObjString *join_strings(ObjString *a, ObjString *b)
+{
     int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
+    char *chars = ALLOCATE(char, length + 1, MEM_STRING_CHARS);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
+    return take_string(chars, length);
+}
+
+void concatenate()
+{
+    ObjString *b = AS_STRING(pop());
+    ObjString *a = AS_STRING(pop());
+    push(OBJ_VAL(join_strings(a, b)));
+}
+
+// register_arithmetic computes "a op b" for the register forms of arithmetic, where group is the first
+// opcode of the instruction's group (e.g. OP_ADD_LL). It's only ever called with a constant group, so the
+// switch folds away. Returns false if the operands have the wrong types
+static inline bool register_arithmetic(OpCode group, Value a, Value b, Value *result)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        double left = AS_NUMBER(a);
+        double right = AS_NUMBER(b);
+        switch (group)
+        {
+        case OP_ADD_LL:
+            *result = NUMBER_VAL(left + right);
+            return true;
+        case OP_SUBTRACT_LL:
+            *result = NUMBER_VAL(left - right);
+            return true;
+        case OP_MULTIPLY_LL:
+            *result = NUMBER_VAL(left * right);
+            return true;
+        default:
+            *result = NUMBER_VAL(left / right);
+            return true;
+        }
+    }
+    if (group == OP_ADD_LL && IS_STRING(a) && IS_STRING(b))
+    {
+        // joined straight from the slots: pushing them would take stack the frame's max_stack doesn't have
+        *result = OBJ_VAL(join_strings(AS_STRING(a), AS_STRING(b)));
+        return true;
+    }
+    return false;
+}
 
-    ObjString *result = take_string(chars, length);
-    push(OBJ_VAL(result));
+// safepoint is the rare part of SAFEPOINT, kept out of run() so it doesn't get in the way of the common one.
+// It's where a collection the allocator asked for starts: between instructions, everything the program
+// can still get to is on the stack or reachable from the other roots, rather than in some C local. A
+// program that has outgrown the heap limit gets stopped here. And the program is suspended once it's out
+// of fuel or something interrupted it (see interrupt_vm). It resumes from the start of the instruction, so
+// the frame's ip is moved back to its opcode
+static __attribute__((noinline)) InterpretResult safepoint()
+{
+    // cleared first, so a request that comes in meanwhile stops the program at the next safepoint again
+    vm.safepoint_requested = false;
+    if (vm.gc_requested && !collect_garbage())
+    {
+        runtime_error("Out of memory.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    if (vm.interrupted || vm.fuel <= 0)
+    {
+        vm.interrupted = false;
+        vm.frames[vm.frame_count - 1].ip--;
+        return INTERPRET_SUSPENDED;
+    }
+    return INTERPRET_OK;
 }
 
 static InterpretResult run()
 {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+    // the running frame and its ip are cached in locals, which the compiler can keep in registers,
+    // and written back to the frame only when another frame takes over or there's an error
+    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    uint8_t *ip = frame->ip;
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() (AS_STRING(READ_CONSTANT()))
-#define READ_CONSTANT_LONG() (vm.chunk->constants.values[READ_BYTE() | READ_BYTE() | READ_BYTE()])
+// the three operand bytes of a long constant are little-endian; the bytes are read through
+// ip explicitly since the order in which operands of | are evaluated is unspecified
+#define READ_CONSTANT_LONG() \
+    (ip += 3, frame->function->chunk.constants.values[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)])
+// the stack trace needs to know where the running frame is
+#define RUNTIME_ERROR(...) (frame->ip = ip, runtime_error(__VA_ARGS__))
+// JIT_ENTER hands the running frame over to its machine code, if it has any. That's checked where machine
+// code is likely to take over: at loops, after calls and returns, and after the instructions the machine
+// code leaves to the interpreter in the middle of a loop. The machine code runs up to the next instruction
+// it leaves to the interpreter
+#define JIT_ENTER()                       \
+    if (frame->function->jit != NULL)     \
+    {                                     \
+        frame->ip = ip;                   \
+        jit_run(frame);                   \
+        ip = frame->ip;                   \
+    }
+// SAFEPOINT is where the program can be stopped, at the start of loops and calls, so every way of running
+// for long gets to one. It's also where the program burns its fuel. Anything more is up to safepoint()
+#define SAFEPOINT()                                                    \
+    if (vm.safepoint_requested || vm.fuel <= 0)                        \
+    {                                                                  \
+        frame->ip = ip;                                                \
+        InterpretResult result = safepoint();                          \
+        if (result != INTERPRET_OK)                                    \
+            return result;                                             \
+    }                                                                  \
+    vm.fuel--;
 // BINARY_OP uses a block to ensure that the statements executed have the same scope.
 // notice that in Lox, we define order of evaluation from left to right
 // so for example if we want to calculate expr_a + expr_b, we evaluate
@@ -98,34 +631,100 @@ static InterpretResult run()
     {                                                   \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
         {                                               \
-            runtime_error("Operands must be numbers."); \
+            RUNTIME_ERROR("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR;             \
+        }                                               \
+        /* the result replaces the left operand */      \
+        Value *top = vm.stack_top;                      \
+        double right = AS_NUMBER(top[-1]);              \
+        double left = AS_NUMBER(top[-2]);               \
+        top[-2] = value_Type(left op right);            \
+        vm.stack_top = top - 1;                         \
+    }
+// REGISTER_OP runs one register form of arithmetic: [dst] when it stores into a local, the left operand's
+// slot, then the right operand's slot or constant index
+#define REGISTER_OP(group, has_dst, constant_operand, message)                         \
+    {                                                                                  \
+        uint8_t dst = has_dst ? READ_BYTE() : 0;                                       \
+        Value a = frame->slots[READ_BYTE()];                                           \
+        Value b = constant_operand ? READ_CONSTANT() : frame->slots[READ_BYTE()];      \
+        Value result;                                                                  \
+        if (!register_arithmetic(group, a, b, &result))                                \
+        {                                                                              \
+            RUNTIME_ERROR(message);                                                    \
+            return INTERPRET_RUNTIME_ERROR;                                            \
+        }                                                                              \
+        if (has_dst)                                                                   \
+            frame->slots[dst] = result;                                                \
+        else                                                                           \
+            push(result);                                                              \
+        break;                                                                         \
+    }
+// REGISTER_CASES expands into the four forms of a group: _LL, _LK, _LL_TO and _LK_TO
+#define REGISTER_CASES(group, message)                 \
+    case group:                                        \
+        REGISTER_OP(group, false, false, message)      \
+    case group + 1:                                    \
+        REGISTER_OP(group, false, true, message)       \
+    case group + 2:                                    \
+        REGISTER_OP(group, true, false, message)       \
+    case group + 3:                                    \
+        REGISTER_OP(group, true, true, message)
+// jump offsets are two bytes, big-endian
+#define READ_SHORT() \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+// COMPARE_JUMP pops two numbers, left and right, and jumps if condition holds for them. It's the fused
+// version of a comparison followed by a conditional jump, so condition is the negation of the source
+#define COMPARE_JUMP(condition)                                \
+    {                                                   \
+        uint16_t offset = READ_SHORT();                 \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
+        {                                               \
+            RUNTIME_ERROR("Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR;             \
         }                                               \
         double right = AS_NUMBER(pop());                \
         double left = AS_NUMBER(pop());                 \
-        push(value_Type(left op right));                \
+        if (condition)                                  \
+            ip += offset;                            \
     }
 
     for (;;)
     {
 #ifdef DEBUG_TRACE_EXECUTION
         // contents of the stack
-        printf("          ");
+        write_cstring("          ");
         for (Value *slot = vm.stack; slot < vm.stack_top; slot++)
         {
-            printf("[ ");
+            write_cstring("[ ");
             print_value(*slot);
-            printf(" ]");
+            write_cstring(" ]");
         }
-        printf("\n");
-        disassemble_instruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+        write_char('\n');
+        disassemble_instruction(&frame->function->chunk, (int)(ip - frame->function->chunk.code));
 #endif
         uint8_t instruction;
         switch (instruction = READ_BYTE())
         {
         case OP_RETURN:
         {
-            return INTERPRET_OK;
+            Value result = pop();
+            close_upvalues(frame->slots);
+            vm.frame_count--;
+            if (vm.frame_count == 0)
+            {
+                // pop the top-level script function
+                pop();
+                return INTERPRET_OK;
+            }
+
+            // discard the callee's arguments and locals, and the callee itself
+            vm.stack_top = frame->slots;
+            push(result);
+            frame = &vm.frames[vm.frame_count - 1];
+            ip = frame->ip;
+            JIT_ENTER();
+            break;
         }
         case OP_POP:
         {
@@ -143,6 +742,7 @@ static InterpretResult run()
         case OP_CONSTANT_LONG:
         {
             Value constant = READ_CONSTANT_LONG();
+            push(constant);
             break;
         }
         case OP_TRUE:
@@ -158,7 +758,7 @@ static InterpretResult run()
         {
             if (!IS_NUMBER(peek(0)))
             {
-                runtime_error("Operand must be a number.");
+                RUNTIME_ERROR("Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
             else
@@ -171,25 +771,63 @@ static InterpretResult run()
         case OP_NOT:
             push(BOOL_VAL(is_falsey(pop())));
             break;
+        // OP_ADD quickens: the first time it runs, it rewrites itself into the specialized form for the
+        // operands it sees, which only has to check its guess. A specialized add that guessed wrong
+        // de-quickens into OP_ADD_GENERIC for good, so a site that sees both kinds doesn't flip-flop
         case OP_ADD:
+        case OP_ADD_GENERIC:
         {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
             {
-                concatenate();
+                if (instruction == OP_ADD)
+                    ip[-1] = OP_ADD_NUMBER;
+                Value *top = vm.stack_top;
+                top[-2] = NUMBER_VAL(AS_NUMBER(top[-2]) + AS_NUMBER(top[-1]));
+                vm.stack_top = top - 1;
             }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            else if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
             {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                if (instruction == OP_ADD)
+                    ip[-1] = OP_ADD_STRING;
+                concatenate();
             }
             else
             {
-                runtime_error("Operands must be both strings or numbers");
+                RUNTIME_ERROR("Operands must be both strings or numbers");
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
         }
+        case OP_ADD_NUMBER:
+        {
+            Value *top = vm.stack_top;
+            if (!IS_NUMBER(top[-1]) || !IS_NUMBER(top[-2]))
+            {
+                // run the instruction again as the generic add
+                ip[-1] = OP_ADD_GENERIC;
+                ip--;
+                break;
+            }
+            top[-2] = NUMBER_VAL(AS_NUMBER(top[-2]) + AS_NUMBER(top[-1]));
+            vm.stack_top = top - 1;
+            break;
+        }
+        case OP_ADD_STRING:
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1)))
+            {
+                ip[-1] = OP_ADD_GENERIC;
+                ip--;
+                break;
+            }
+            concatenate();
+            break;
+            REGISTER_CASES(OP_ADD_LL, "Operands must be both strings or numbers")
+            REGISTER_CASES(OP_SUBTRACT_LL, "Operands must be numbers.")
+            REGISTER_CASES(OP_MULTIPLY_LL, "Operands must be numbers.")
+            REGISTER_CASES(OP_DIVIDE_LL, "Operands must be numbers.")
+        case OP_STORE_LOCAL:
+            frame->slots[READ_BYTE()] = pop();
+            break;
         case OP_SUBTRACT:
             BINARY_OP(NUMBER_VAL, -)
             break;
@@ -214,7 +852,7 @@ static InterpretResult run()
             break;
         case OP_PRINT:
             print_value(pop());
-            printf("\n");
+            write_line_end();
             break;
         case OP_DEFINE_GLOBAL:
         {
@@ -232,7 +870,7 @@ static InterpretResult run()
             bool ok = table_get(&vm.globals, global_name, &global_value);
             if (!ok)
             {
-                runtime_error("Undefined variable '%s'.", global_name->chars);
+                RUNTIME_ERROR("Undefined variable '%s'.", global_name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
             push(global_value);
@@ -249,7 +887,7 @@ static InterpretResult run()
             {
                 // Lox doesn't support implicit declaration
                 table_delete(&vm.globals, global_name);
-                runtime_error("Undefined variable '%s'.", global_name->chars);
+                RUNTIME_ERROR("Undefined variable '%s'.", global_name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
@@ -259,7 +897,7 @@ static InterpretResult run()
             uint8_t slot = READ_BYTE();
             // it's already on the stack, but we have to push it to the top of the stack
             // since all the other instructions assume their operands are at the top of the stack
-            push(vm.stack[slot]);
+            push(frame->slots[slot]);
             break;
         }
         case OP_SET_LOCAL:
@@ -267,7 +905,292 @@ static InterpretResult run()
             uint8_t slot = READ_BYTE();
             // don't pop off the stack, because assignment is an expression, and that expression
             // evaluates to the right hand side of the assignment, so we keep it on the stack
-            vm.stack[slot] = peek(0);
+            frame->slots[slot] = peek(0);
+            break;
+        }
+        case OP_JUMP:
+        {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            break;
+        }
+        case OP_JUMP_IF_FALSE:
+        {
+            // leaves the condition on the stack, "and" and "or" need it as their value
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(peek(0)))
+                ip += offset;
+            break;
+        }
+        case OP_POP_JUMP_IF_FALSE:
+        {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(pop()))
+                ip += offset;
+            break;
+        }
+        // !(a < b) isn't the same as a >= b when either is NaN, so the conditions are spelled out as
+        // the exact negations of the comparisons they replace
+        case OP_JUMP_IF_NOT_LESS:
+            COMPARE_JUMP(!(left < right))
+            break;
+        case OP_JUMP_IF_NOT_GREATER:
+            COMPARE_JUMP(!(left > right))
+            break;
+        case OP_JUMP_IF_GREATER:
+            // a <= b compiles to !(a > b), so it's false when a > b
+            COMPARE_JUMP(left > right)
+            break;
+        case OP_JUMP_IF_LESS:
+            COMPARE_JUMP(left < right)
+            break;
+        case OP_JUMP_IF_NOT_EQUAL:
+        {
+            uint16_t offset = READ_SHORT();
+            Value b = pop();
+            Value a = pop();
+            if (!value_equals(a, b))
+                ip += offset;
+            break;
+        }
+        case OP_JUMP_IF_EQUAL:
+        {
+            uint16_t offset = READ_SHORT();
+            Value b = pop();
+            Value a = pop();
+            if (value_equals(a, b))
+                ip += offset;
+            break;
+        }
+        case OP_LOOP:
+        {
+            SAFEPOINT();
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            warm_up(frame->function);
+            JIT_ENTER();
+            break;
+        }
+        case OP_CALL:
+        {
+            SAFEPOINT();
+            int arg_count = READ_BYTE();
+            frame->ip = ip;
+            if (!call_value(peek(arg_count), arg_count))
+                return INTERPRET_RUNTIME_ERROR;
+            // a function call pushed a new frame, a native call left the current one running
+            frame = &vm.frames[vm.frame_count - 1];
+            ip = frame->ip;
+            JIT_ENTER();
+            break;
+        }
+        case OP_TAIL_CALL:
+        {
+            SAFEPOINT();
+            int arg_count = READ_BYTE();
+            Value callee = peek(arg_count);
+            if (IS_FUNCTION(callee) || IS_CLOSURE(callee))
+            {
+                ObjFunction *function;
+                ObjUpvalue **upvalues = NULL;
+                if (IS_CLOSURE(callee))
+                {
+                    function = AS_CLOSURE(callee)->function;
+                    upvalues = AS_CLOSURE(callee)->upvalues;
+                }
+                else
+                {
+                    function = AS_FUNCTION(callee);
+                }
+                if (arg_count != function->arity)
+                {
+                    RUNTIME_ERROR("Expected %d arguments but got %d.", function->arity, arg_count);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // slide the callee and its arguments down over the current frame, whose locals are
+                // dead, and start over in the callee. The caller won't show up in stack traces. Its
+                // captured locals have to move off the stack before they're overwritten
+                frame->ip = ip;
+                if (!ensure_stack(frame->slots, function))
+                    return INTERPRET_RUNTIME_ERROR;
+                close_upvalues(frame->slots);
+                Value *args = vm.stack_top - arg_count - 1;
+                memmove(frame->slots, args, (arg_count + 1) * sizeof(Value));
+                vm.stack_top = frame->slots + arg_count + 1;
+                frame->function = function;
+                frame->upvalues = upvalues;
+                ip = function->chunk.code;
+                warm_up(function);
+                JIT_ENTER();
+                break;
+            }
+
+            // everything else takes the regular path: natives return to this frame, and the OP_RETURN that
+            // follows returns their result, classes and bound methods return to it from a frame of their own
+            frame->ip = ip;
+            if (!call_value(callee, arg_count))
+                return INTERPRET_RUNTIME_ERROR;
+            frame = &vm.frames[vm.frame_count - 1];
+            ip = frame->ip;
+            JIT_ENTER();
+            break;
+        }
+        case OP_CLOSURE:
+        {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure *closure = new_closure(function);
+            push(OBJ_VAL(closure));
+            for (int i = 0; i < closure->upvalue_count; i++)
+            {
+                uint8_t is_local = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (is_local)
+                    closure->upvalues[i] = capture_upvalue(frame->slots + index);
+                else
+                    closure->upvalues[i] = frame->upvalues[index];
+            }
+            break;
+        }
+        case OP_GET_UPVALUE:
+        {
+            uint8_t slot = READ_BYTE();
+            push(*frame->upvalues[slot]->location);
+            break;
+        }
+        case OP_SET_UPVALUE:
+        {
+            uint8_t slot = READ_BYTE();
+            // a closed upvalue is in the heap, an open one on the stack, which needs no barrier but
+            // doesn't mind one
+            write_barrier(*frame->upvalues[slot]->location);
+            *frame->upvalues[slot]->location = peek(0);
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            close_upvalues(vm.stack_top - 1);
+            pop();
+            break;
+        case OP_CLASS:
+            push(OBJ_VAL(new_class(READ_STRING())));
+            break;
+        case OP_INHERIT:
+        {
+            Value superclass = peek(1);
+            if (!IS_CLASS(superclass))
+            {
+                RUNTIME_ERROR("Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            // copy-down inheritance: the methods the subclass defines next override the copies, and a
+            // method lookup never has to walk up the class hierarchy
+            ObjClass *subclass = AS_CLASS(peek(0));
+            table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+            pop();
+            break;
+        }
+        case OP_METHOD:
+            define_method(READ_STRING());
+            break;
+        case OP_GET_PROPERTY:
+        {
+            ObjString *name = READ_STRING();
+            PropertyCache *cache = &frame->function->caches[READ_SHORT()];
+            if (get_field_cached(name, cache))
+            {
+                JIT_ENTER();
+                break;
+            }
+            if (!IS_INSTANCE(peek(0)))
+            {
+                RUNTIME_ERROR("Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            // fields shadow methods, so it's only a method if there's no such field
+            frame->ip = ip;
+            if (!bind_method(AS_INSTANCE(peek(0))->klass, name))
+                return INTERPRET_RUNTIME_ERROR;
+            break;
+        }
+        case OP_INVOKE:
+        {
+            SAFEPOINT();
+            ObjString *name = READ_STRING();
+            int arg_count = READ_BYTE();
+            MethodCache *cache = &frame->function->method_caches[READ_SHORT()];
+            frame->ip = ip;
+
+            Value receiver = peek(arg_count);
+            if (!IS_INSTANCE(receiver))
+            {
+                runtime_error("Only instances have methods.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!invoke(AS_INSTANCE(receiver), name, arg_count, cache))
+                return INTERPRET_RUNTIME_ERROR;
+            frame = &vm.frames[vm.frame_count - 1];
+            ip = frame->ip;
+            JIT_ENTER();
+            break;
+        }
+        case OP_INVOKE_THIS:
+        {
+            SAFEPOINT();
+            ObjString *name = READ_STRING();
+            int arg_count = READ_BYTE();
+            MethodCache *cache = &frame->function->method_caches[READ_SHORT()];
+            frame->ip = ip;
+
+            // "this" can't be assigned to, so it's always the instance the method was called on
+            if (!invoke(AS_INSTANCE(peek(arg_count)), name, arg_count, cache))
+                return INTERPRET_RUNTIME_ERROR;
+            frame = &vm.frames[vm.frame_count - 1];
+            ip = frame->ip;
+            JIT_ENTER();
+            break;
+        }
+        case OP_SUPER_INVOKE:
+        {
+            SAFEPOINT();
+            ObjString *name = READ_STRING();
+            int arg_count = READ_BYTE();
+            MethodCache *cache = &frame->function->method_caches[READ_SHORT()];
+            frame->ip = ip;
+
+            // the superclass of a site only changes if its class declaration runs again, so the
+            // cache is practically always monomorphic, and fields never shadow super methods
+            ObjClass *superclass = AS_CLASS(pop());
+            MethodCacheEntry *entry = find_method_entry(cache, superclass);
+            bool ok = entry != NULL ? call_method(entry->method, arg_count)
+                                    : invoke_from_class(superclass, name, arg_count, cache, superclass);
+            if (!ok)
+                return INTERPRET_RUNTIME_ERROR;
+            frame = &vm.frames[vm.frame_count - 1];
+            ip = frame->ip;
+            JIT_ENTER();
+            break;
+        }
+        case OP_GET_SUPER:
+        {
+            ObjString *name = READ_STRING();
+            ObjClass *superclass = AS_CLASS(pop());
+            frame->ip = ip;
+            if (!bind_method(superclass, name))
+                return INTERPRET_RUNTIME_ERROR;
+            break;
+        }
+        case OP_SET_PROPERTY:
+        {
+            ObjString *name = READ_STRING();
+            PropertyCache *cache = &frame->function->caches[READ_SHORT()];
+            if (!set_property_cached(name, cache))
+            {
+                RUNTIME_ERROR("Only instances have fields.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            JIT_ENTER();
             break;
         }
         }
@@ -278,25 +1201,52 @@ static InterpretResult run()
 #undef READ_STRING
 #undef READ_CONSTANT_LONG
 #undef BINARY_OP
+#undef REGISTER_OP
+#undef REGISTER_CASES
+#undef READ_SHORT
+#undef COMPARE_JUMP
+#undef RUNTIME_ERROR
+#undef JIT_ENTER
+#undef SAFEPOINT
 }
 
-InterpretResult interpret(const char *source)
+// interpret compiles and runs source, which doesn't have to be NUL-terminated
+InterpretResult interpret(const char *source, size_t length)
 {
-    Chunk chunk;
-    init_chunk(&chunk);
-
-    if (!compile(source, &chunk))
-    {
-        free_chunk(&chunk);
+    ObjFunction *function = compile(source, length);
+    if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
-    }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    reset_stack();
+    // the script runs like a call to a function without arguments
+    push(OBJ_VAL(function));
+    call(function, NULL, 0);
+    return resume();
+}
+
+InterpretResult resume()
+{
+    if (vm.frame_count == 0)
+        return INTERPRET_OK;
 
-    InterpretResult result = run();
+    // a push into the guard page comes back here. The innermost frame's line may be off, run() only
+    // keeps its ip in the frame at calls. The signal mask is saved too: the jump leaves the handler with
+    // SIGSEGV blocked, and the next overflow, e.g. on the REPL's next line, would kill the process
+    if (sigsetjmp(stack_overflow, 1) != 0)
+    {
+        runtime_error("Stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    return run();
+}
 
-    free_chunk(&chunk);
+void set_fuel(int64_t fuel)
+{
+    vm.fuel = fuel;
+}
 
-    return result;
+void interrupt_vm()
+{
+    vm.interrupted = true;
+    vm.safepoint_requested = true;
 }
\ No newline at end of file
@@ -1,24 +1,77 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <signal.h>
+
 #include "chunk.h"
+#include "memory.h"
+#include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define STACK_MAX 256
+// the stack is reserved address space for this many values (64MB), the OS commits the pages as they're used
+#define STACK_MAX (4 * 1024 * 1024)
+// the frames are reserved the same way. Every frame has at least its callee's slot on the stack, so there's
+// room for as many frames as the stack can ever hold, and only the stack needs checking for overflow
+#define FRAMES_MAX STACK_MAX
 
+// CallFrame is an ongoing function call. The frames live in a preallocated array, and arguments and
+// locals live on the VM's stack, so calling a function doesn't allocate anything
 typedef struct
 {
-    Chunk *chunk;
-    // Instruction Pointer points to the instruction about to be executed
+    ObjFunction *function;
+    // upvalues are the captured variables of the closure being run, NULL for a plain function
+    ObjUpvalue **upvalues;
+    // Instruction Pointer points to the instruction about to be executed. The frame that's running
+    // keeps its ip in a local variable of run(), this is where it's kept while that frame calls another
     uint8_t *ip;
-    Value stack[STACK_MAX];
+    // slots points to the callee in the stack, followed by the arguments and then the locals
+    Value *slots;
+} CallFrame;
+
+typedef struct
+{
+    CallFrame *frames;
+    int frame_count;
+    // the stack is only checked for overflow when a frame starts, for the most the frame's function can
+    // push (see ObjFunction.max_stack), so pushing and popping never check. It never moves
+    Value *stack;
     // stack_top points to the array element just past the top array element in the stack.
     // Thus we can indicate the stack is empty by pointing at 0
     Value *stack_top;
+    ObjUpvalue *open_upvalues;
     Obj *objects;
-    Table strings;
+    // strings holds the interned strings, so that equal strings are mostly the same object (see take_string)
+    StringSet strings;
     Table globals;
+    // init_string is "init", the name of initializers, interned once rather than at every instantiation
+    ObjString *init_string;
+
+    // the garbage collector's state, see memory.c. gc_requested is set once the heap has outgrown next_gc,
+    // and the collection starts at the next safepoint
+    GCPhase gc_phase;
+    bool gc_requested;
+    size_t next_gc;
+    // gc_black is the value of OBJ_MARKED that means marked in this collection
+    bool gc_black;
+    // the gray objects are marked, but the objects they refer to may not be yet
+    Obj **gray_stack;
+    int gray_count;
+    int gray_capacity;
+    // unswept holds the objects the sweep hasn't got to yet, while vm.objects collects the ones it kept
+    // and the new ones
+    Obj *unswept;
+    size_t gc_cycles;
+    // heap_limit is the most the heap may hold, 0 for no limit (see set_heap_limit)
+    size_t heap_limit;
+
+    // fuel is how many more loops and calls the program may go through before it's suspended (see
+    // set_fuel). safepoint_requested stops it at the next one anyway, and the safepoint looks at why: the
+    // collector wants to start (gc_requested) or the program was interrupted (interrupted). They're
+    // volatile, since they're also set from outside the program, e.g. by a timer's signal handler
+    int64_t fuel;
+    volatile sig_atomic_t safepoint_requested;
+    volatile sig_atomic_t interrupted;
 } VM;
 
 typedef enum
@@ -28,14 +81,39 @@ typedef enum
     INTERPRET_COMPILE_ERROR,
     // VM detects runtime errors
     INTERPRET_RUNTIME_ERROR,
+    // the program ran out of fuel or was interrupted, resume() carries on where it stopped
+    INTERPRET_SUSPENDED,
 } InterpretResult;
 
+// the fuel of a program that may run forever
+#define FUEL_UNLIMITED INT64_MAX
+
 extern VM vm;
 
+// write_barrier has to be called with what a slot in the heap (a field, a table entry, a closed upvalue)
+// held, before it's overwritten. While marking, the collector gets to every object that was reachable when
+// the collection started, even if the program drops its last reference to it halfway, so marking never
+// misses an object the program moved from a slot it hasn't scanned yet to one it already has. The stack
+// and the other roots don't need it, they're all scanned when the collection starts
+static inline void write_barrier(Value old)
+{
+    if (vm.gc_phase == GC_MARKING && IS_OBJ(old))
+        gc_shade(AS_OBJ(old));
+}
+
 void init_vm();
 void free_vm();
-InterpretResult interpret(const char *source);
+// interpret runs a new program, a suspended one is abandoned
+InterpretResult interpret(const char *source, size_t length);
+InterpretResult resume();
+void set_fuel(int64_t fuel);
+// interrupt_vm suspends the running program at its next loop or call. It's safe to call from a signal handler
+void interrupt_vm();
 void push(Value value);
 Value pop();
+// the parts of the instructions the JIT's machine code calls back into, see vm.c
+void concatenate();
+bool get_field_cached(ObjString *name, PropertyCache *cache);
+bool set_property_cached(ObjString *name, PropertyCache *cache);
 
 #endif
\ No newline at end of file